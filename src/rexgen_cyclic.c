@@ -0,0 +1,432 @@
+// SPDX-License-Identifier: GPL-2.0
+/* 
+    USB to SocketCAN driver for ReXgen
+    Copyright (C) 1999-2021 Influx Technology LTD, UK. All rights reserved.
+    Contacts: https://www.influxtechnology.com/contact
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Cyclic transmit table per channel, in sysfs as tx_cyclic on the CAN interface:
+//     echo "<period us> <frame>" > tx_cyclic
+// adds a frame or updates the entry with the same ID in place, keeping its cycle
+// when the period is unchanged and otherwise counting the new period from the
+// last transmission; period 0 removes it. Frames use the cansend syntax, "123#1122" or "123##1112233".
+// All frames due in a timer tick are sent in one live data transfer, they get no
+// echo skb and do not go through the TX queues. In loopback mode they take echo
+// slots without skb, so that the device confirmations of socket frames with the
+// same ID are still matched to the right slot. Nothing is sent in listen-only mode.
+
+#include <linux/version.h>
+#include "rexgen_def.h"
+#include "rexgen_trace.h"
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0))
+#define CYCLIC_TIMER_MODE HRTIMER_MODE_ABS_SOFT
+#else
+#define CYCLIC_TIMER_MODE HRTIMER_MODE_ABS
+#endif
+
+static struct usb_tx_context *cyclic_get_context(struct rexgen_net *net)
+{
+    struct usb_tx_context *context;
+    int i;
+
+    for (i = 0; i < USB_CYCLIC_URBS; i++)
+    {
+        if (test_and_set_bit(i, &net->cyc_busy))
+            continue;
+
+        context = &net->tx_contexts[USB_MAX_TX_URBS + i];
+        context->frames = 0;
+        context->len = 0;
+        context->data_len = 0;
+        context->echoed = net->echo_confirmed;
+        context->echo_index = net->echo_head;
+        return context;
+    }
+
+    return NULL;
+}
+
+static void cyclic_put_context(struct usb_tx_context *context)
+{
+    struct rexgen_net *net = context->net;
+
+    clear_bit(context - &net->tx_contexts[USB_MAX_TX_URBS], &net->cyc_busy);
+}
+
+// Called with tx_lock held, the echo slots are taken in submission order
+static void cyclic_flush(struct rexgen_net *net, struct usb_tx_context *context)
+{
+    struct urb *urb;
+    int err;
+
+    if (!context)
+        return;
+
+    if (!context->frames)
+    {
+        cyclic_put_context(context);
+        return;
+    }
+
+    urb = context->urb;
+    urb->transfer_buffer_length = context->len;
+    usb_anchor_urb(urb, &net->tx_submitted);
+
+    err = usb_submit_urb(urb, GFP_ATOMIC);
+    trace_rexgen_tx_submit(net->netdev, context, err);
+    if (unlikely(err))
+    {
+        usb_unanchor_urb(urb);
+        this_cpu_inc(net->stats->tx_submit_errors);
+        rexgen_tx_stats(net, 0, 0, context->frames, 0);
+        if (context->echoed)
+            echo_tx_failed(net, context->echo_index, context->frames);
+        cyclic_put_context(context);
+        return;
+    }
+
+    this_cpu_inc(net->stats->tx_urbs);
+    this_cpu_add(net->stats->tx_urb_bytes, context->len);
+    this_cpu_add(net->stats->tx_frames, context->frames);
+}
+
+void rexgen_cyclic_callback(struct urb *urb)
+{
+    struct usb_tx_context *context = urb->context;
+    struct rexgen_net *net = context->net;
+
+    trace_rexgen_tx_complete(net->netdev, context, urb->status);
+    if (urb->status)
+        this_cpu_inc(net->stats->tx_urb_errors);
+
+    // frames with echo slots are counted when confirmed or skipped by tx_confirm,
+    // or here when their transfer failed and no confirmation will come
+    if (urb->status)
+        rexgen_tx_stats(net, 0, 0, 0, context->frames);
+    else if (!context->echoed)
+        rexgen_tx_stats(net, context->frames, context->data_len, 0, 0);
+
+    if (urb->status && context->echoed)
+        echo_tx_failed(net, context->echo_index, context->frames);
+
+    cyclic_put_context(context);
+}
+
+static bool cyclic_lock_tx(struct rexgen_net *net)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0))
+    spin_lock(&net->tx_lock);
+    return true;
+#else
+    // the timer runs in hard irq context, on_xmit may hold tx_lock on this CPU
+    return spin_trylock(&net->tx_lock);
+#endif
+}
+
+static enum hrtimer_restart cyclic_timer(struct hrtimer *timer)
+{
+    struct rexgen_net *net = container_of(timer, struct rexgen_net, cyc_timer);
+    struct usb_tx_context *context = NULL;
+    struct rexgen_cyclic *cyc;
+    u64 now = ktime_get_ns(), next = U64_MAX;
+    unsigned long flags;
+    bool send = net->can.state != CAN_STATE_BUS_OFF &&
+        !(net->can.ctrlmode & CAN_CTRLMODE_LISTENONLY);
+    unsigned int i;
+
+    spin_lock_irqsave(&net->cyc_lock, flags);
+    if (!cyclic_lock_tx(net))
+    {
+        spin_unlock_irqrestore(&net->cyc_lock, flags);
+        hrtimer_forward_now(timer, ns_to_ktime(10 * NSEC_PER_USEC));
+        return HRTIMER_RESTART;
+    }
+
+    for (i = 0; i < net->cyc_count; i++)
+    {
+        cyc = &net->cyc[i];
+        if (cyc->next_ns <= now)
+        {
+            if (send && (!context || context->len + RexRecordMaxLength > USB_TX_BUFFER_SIZE))
+            {
+                cyclic_flush(net, context);
+                context = cyclic_get_context(net);
+            }
+
+            if (context && context->echoed && !echo_cyclic_frame(net, cyc->can_id, cyc->len))
+            {
+                rexgen_tx_stats(net, 0, 0, 1, 0);
+            }
+            else if (context)
+            {
+                context->len += frame2rec(context->buf + context->len,
+                        net->usb_block_uid[IDX_CAN_BLOCK_UID_TX],
+                        cyc->can_id & CAN_EFF_MASK, cyc->flags, cyc->data, cyc->len);
+                context->data_len += cyc->len;
+                context->frames++;
+            }
+            else if (send)
+            {
+                rexgen_tx_stats(net, 0, 0, 1, 0);
+            }
+
+            // keep the phase, periods missed while the timer was late are skipped
+            cyc->next_ns += cyc->period_ns;
+            if (cyc->next_ns <= now)
+                cyc->next_ns += (div64_u64(now - cyc->next_ns, cyc->period_ns) + 1) * cyc->period_ns;
+        }
+
+        next = min(next, cyc->next_ns);
+    }
+    cyclic_flush(net, context);
+    spin_unlock(&net->tx_lock);
+    spin_unlock_irqrestore(&net->cyc_lock, flags);
+
+    if (next == U64_MAX)
+        return HRTIMER_NORESTART;
+
+    hrtimer_set_expires(timer, ns_to_ktime(next));
+    return HRTIMER_RESTART;
+}
+
+// (Re)arms the timer for the earliest entry, process context under rtnl
+static void cyclic_rearm(struct rexgen_net *net)
+{
+    u64 next = U64_MAX;
+    unsigned long flags;
+    unsigned int i;
+
+    hrtimer_cancel(&net->cyc_timer);
+
+    spin_lock_irqsave(&net->cyc_lock, flags);
+    for (i = 0; i < net->cyc_count; i++)
+        next = min(next, net->cyc[i].next_ns);
+    spin_unlock_irqrestore(&net->cyc_lock, flags);
+
+    if (next != U64_MAX)
+        hrtimer_start(&net->cyc_timer, ns_to_ktime(next), CYCLIC_TIMER_MODE);
+}
+
+void rexgen_cyclic_init(struct rexgen_net *net)
+{
+    spin_lock_init(&net->cyc_lock);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0))
+    hrtimer_setup(&net->cyc_timer, cyclic_timer, CLOCK_MONOTONIC, CYCLIC_TIMER_MODE);
+#else
+    hrtimer_init(&net->cyc_timer, CLOCK_MONOTONIC, CYCLIC_TIMER_MODE);
+    net->cyc_timer.function = cyclic_timer;
+#endif
+}
+
+// called from on_open once the TX URBs are set up
+void rexgen_cyclic_start(struct rexgen_net *net)
+{
+    cyclic_rearm(net);
+}
+
+// called from on_close before the TX URBs are killed
+void rexgen_cyclic_stop(struct rexgen_net *net)
+{
+    hrtimer_cancel(&net->cyc_timer);
+}
+
+void rexgen_cyclic_free(struct rexgen_net *net)
+{
+    kfree(net->cyc);
+    net->cyc = NULL;
+    net->cyc_count = 0;
+}
+
+static bool cyclic_fd_len_valid(unsigned int len)
+{
+    return len <= 8 || len == 12 || len == 16 || len == 20 ||
+        len == 24 || len == 32 || len == 48 || len == 64;
+}
+
+// "<period us> <id>#<data>" or "<period us> <id>##<flags><data>", ids as in the RX filter
+static int parse_cyclic(struct rexgen_cyclic *cyc, u32 *period_us, char *str)
+{
+    char *period, *data;
+    unsigned int len, max = CAN_MAX_DLEN;
+    u32 id;
+    int fdflags;
+    bool eff;
+
+    period = strsep(&str, " ");
+    if (!str || kstrtou32(period, 10, period_us))
+        return -EINVAL;
+
+    str = skip_spaces(str);
+    data = strchr(str, '#');
+    if (!data)
+        return -EINVAL;
+    *data++ = 0;
+
+    eff = strlen(str) == 8;
+    if ((!eff && strlen(str) != 3) || kstrtou32(str, 16, &id) ||
+        id > (eff ? CAN_EFF_MASK : CAN_SFF_MASK))
+        return -EINVAL;
+
+    memset(cyc, 0, sizeof(*cyc));
+    cyc->can_id = id | (eff ? CAN_EFF_FLAG : 0);
+    cyc->flags = eff ? DataFrame_IDE : 0;
+
+    if (*data == '#')
+    {
+        fdflags = hex_to_bin(data[1]);
+        if (fdflags < 0)
+            return -EINVAL;
+
+        cyc->flags |= DataFrame_EDL;
+        if (fdflags & CANFD_BRS)
+            cyc->flags |= DataFrame_BRS;
+        max = CANFD_MAX_DLEN;
+        data += 2;
+    }
+
+    len = strlen(data);
+    if (len % 2 || len / 2 > max || hex2bin(cyc->data, data, len / 2))
+        return -EINVAL;
+
+    cyc->len = len / 2;
+    if ((cyc->flags & DataFrame_EDL) && !cyclic_fd_len_valid(cyc->len))
+        return -EINVAL;
+
+    if (*period_us && *period_us < USB_CYCLIC_MIN_PERIOD_US)
+        return -EINVAL;
+
+    return 0;
+}
+
+static ssize_t tx_cyclic_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct rexgen_net *net = netdev_priv(to_net_dev(d));
+    const struct rexgen_cyclic *cyc;
+    unsigned long flags;
+    ssize_t len = 0;
+    unsigned int i;
+
+    spin_lock_irqsave(&net->cyc_lock, flags);
+    for (i = 0; i < net->cyc_count; i++)
+    {
+        cyc = &net->cyc[i];
+        len += scnprintf(buf + len, PAGE_SIZE - len,
+                (cyc->can_id & CAN_EFF_FLAG) ? "%llu %08x#" : "%llu %03x#",
+                div_u64(cyc->period_ns, NSEC_PER_USEC), cyc->can_id & CAN_EFF_MASK);
+        if (cyc->flags & DataFrame_EDL)
+            len += scnprintf(buf + len, PAGE_SIZE - len, "#%x",
+                    (cyc->flags & DataFrame_BRS) ? CANFD_BRS : 0);
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%*phN\n", cyc->len, cyc->data);
+    }
+    spin_unlock_irqrestore(&net->cyc_lock, flags);
+
+    return len;
+}
+
+static ssize_t tx_cyclic_store(struct device *d, struct device_attribute *attr,
+        const char *buf, size_t count)
+{
+    struct net_device *netdev = to_net_dev(d);
+    struct rexgen_net *net = netdev_priv(netdev);
+    struct rexgen_cyclic new, *cyc = NULL;
+    unsigned long flags;
+    u32 period_us;
+    u64 period_ns, now;
+    char *str;
+    bool rearm = false;
+    unsigned int i;
+    int err;
+
+    str = kstrndup(buf, count, GFP_KERNEL);
+    if (!str)
+        return -ENOMEM;
+
+    err = parse_cyclic(&new, &period_us, strim(str));
+    kfree(str);
+    if (err)
+        return err;
+
+    if (!rtnl_trylock())
+        return restart_syscall();
+    if (!net->cyc && period_us)
+    {
+        net->cyc = kcalloc(USB_MAX_CYCLIC, sizeof(*net->cyc), GFP_KERNEL);
+        if (!net->cyc)
+        {
+            rtnl_unlock();
+            return -ENOMEM;
+        }
+    }
+
+    spin_lock_irqsave(&net->cyc_lock, flags);
+    for (i = 0; i < net->cyc_count; i++)
+    {
+        if (net->cyc[i].can_id == new.can_id)
+        {
+            cyc = &net->cyc[i];
+            break;
+        }
+    }
+
+    if (!period_us)
+    {
+        if (cyc)
+            *cyc = net->cyc[--net->cyc_count];
+        else
+            err = -ENOENT;
+    }
+    else if (cyc)
+    {
+        cyc->flags = new.flags;
+        cyc->len = new.len;
+        memcpy(cyc->data, new.data, new.len);
+
+        // in place, a shorter period may bring the next transmission before
+        // the time the timer is set for
+        period_ns = (u64)period_us * NSEC_PER_USEC;
+        if (period_ns != cyc->period_ns)
+        {
+            now = ktime_get_ns();
+            cyc->next_ns = cyc->next_ns - cyc->period_ns + period_ns;
+            if ((s64)(cyc->next_ns - now) < 0)
+                cyc->next_ns = now;
+            cyc->period_ns = period_ns;
+            rearm = true;
+        }
+    }
+    else if (net->cyc_count == USB_MAX_CYCLIC)
+    {
+        err = -ENOSPC;
+    }
+    else
+    {
+        new.period_ns = (u64)period_us * NSEC_PER_USEC;
+        new.next_ns = ktime_get_ns();
+        net->cyc[net->cyc_count++] = new;
+        rearm = true;
+    }
+    spin_unlock_irqrestore(&net->cyc_lock, flags);
+
+    // a new or re-timed frame may be due long before the timer is set for
+    if (rearm && netif_running(netdev))
+        cyclic_rearm(net);
+    rtnl_unlock();
+
+    return err ? err : count;
+}
+DEVICE_ATTR_RW(tx_cyclic);
@@ -24,8 +24,25 @@
 
 #include <linux/usb.h>
 #include <linux/can/dev.h>
+#include <linux/clocksource.h>
+#include <linux/timecounter.h>
+#include <linux/net_tstamp.h>
+#include <linux/uaccess.h>
+#include <linux/sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/pkt_sched.h>
+#include <linux/hrtimer.h>
+#include <linux/hash.h>
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0))
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+
+#include "rexgen_proto.h"
 
-#define USB_CMD_DEBUG               0 // 1- Debug TX/RX commands; 0 - Silence
 #define DeviceName                  "ReXgen"
 
 #define DEVICE_VENDOR_ID            0x16d0
@@ -38,12 +55,31 @@ static const struct usb_device_id influx_usb_table [] = {
 };
 
 #define USB_TIMEOUT                 2000 // msec
-#define USB_MAX_TX_URBS				128
-#define USB_MAX_RX_URBS				4
+#define USB_CMD_TIMEOUT             250 // msec, per attempt
+#define USB_CMD_RETRIES             3
+#define USB_CMD_SLOTS               8 // commands in flight per device
+#define USB_CMD_SEQ_MATCHES         4 // consecutive sequence byte echoes before responses are matched by it
+#define USB_CMD_BUFFER_SIZE         64
+#define USB_CMD_RX_BUFFER_SIZE      512
+#define USB_MAX_TX_URBS				128 // power of 2
+#define USB_MAX_TX_ECHO				256 // power of 2, frames in flight
+#define USB_TX_QUEUES				4 // priority classes, queue 0 is served first
+#define USB_TX_LOW_URBS				2 // transfers in flight below which queues 1.. may send
+#define USB_TX_LOW_ECHO				8 // frames in flight below which queue 1 may send
+#define USB_CYCLIC_URBS				4 // cyclic transfers in flight per channel
+#define USB_TX_CONTEXTS				(USB_MAX_TX_URBS + USB_CYCLIC_URBS)
+#define USB_MAX_CYCLIC				256 // cyclic frames per channel
+#define USB_CYCLIC_MIN_PERIOD_US	100
+#define USB_MAX_RX_URBS				16 // power of 2
+#define USB_DEF_RX_URBS				4
 #define USB_TRANSFER_BLOCK_SIZE 	0x4000
 #define CAN_CHANNELS				2
-#define USB_MAX_NET_DEVICES			5
-#define USB_RX_BUFFER_SIZE			512
+#define USB_RX_BUFFER_SIZE			512 // default, up to USB_TRANSFER_BLOCK_SIZE
+#define USB_TX_BUFFER_SIZE			512
+#define USB_DEF_TX_BATCH			32
+#define USB_MAX_TXQ_RANGES		32 // CAN ID ranges of the TX queue map
+#define USB_MAX_FILTER_RANGES		64 // 29 bit ID ranges of the RX filter
+#define USB_MAX_ERR_FRAMES			20 // error frames per channel and second, state changes always pass
 
 // bittiming parameters 
 #define USB_TSEG1_MIN				1
@@ -103,19 +139,137 @@ static const struct usb_device_id influx_usb_table [] = {
 #define IDX_CAN_BLOCK_UID_TX			1
 #define IDX_CAN_BLOCK_UID_ERR			2
 
-// CAN DataFrame Flags
-#define DataFrame_IDE  1  // Identifier extension bit
-#define DataFrame_SRR  2  // Substitute remote request
-#define DataFrame_EDL  4  // Extended data length
-#define DataFrame_BRS  8  // Bit rate switch
-#define DataFrame_DIR 16  // Frame direction - 0: Rx, 1:Tx
+// RX acceptance filter, checked before an skb is allocated; replaced as a whole
+// under rtnl and read under RCU by the NAPI poll
+struct rexgen_filter_range {
+    u32 from, to;
+};
+
+struct rexgen_filter {
+    struct rcu_head rcu;
+    unsigned long sff[BITS_TO_LONGS(CAN_SFF_MASK + 1)];
+    unsigned int neff;
+    struct rexgen_filter_range eff[USB_MAX_FILTER_RANGES]; // sorted, not overlapping
+};
+
+// CAN ID ranges mapped to TX queues, first match wins; frames without a match
+// are queued by skb->priority. Replaced as a whole like the RX filter.
+struct rexgen_txq_range {
+    u32 from, to;
+    bool eff;
+    u16 queue;
+};
+
+struct rexgen_txq_map {
+    struct rcu_head rcu;
+    unsigned int count;
+    struct rexgen_txq_range ranges[USB_MAX_TXQ_RANGES];
+};
+
+// entry of the cyclic transmit table, sent every period_ns from next_ns on
+struct rexgen_cyclic {
+    canid_t can_id;     // with CAN_EFF_FLAG
+    u8 flags;           // DataFrame_*
+    u8 len;
+    u8 data[CANFD_MAX_DLEN];
+    u64 period_ns;
+    u64 next_ns;
+};
+
+// per-CPU interface counters, RX ones are only updated from the NAPI poll, TX ones
+// from xmit, URB completion and the NAPI poll
+struct rexgen_pcpu_stats {
+    struct u64_stats_sync rx_syncp;
+    u64 rx_packets;
+    u64 rx_bytes;
+    u64 rx_dropped;
+    u64 rx_errors;
+    u64 rx_over_errors;
+
+    struct u64_stats_sync tx_syncp;
+    u64 tx_packets;
+    u64 tx_bytes;
+    u64 tx_dropped;
+    u64 tx_errors;
+
+    // transport counters for ethtool -S, plain per-CPU increments
+    u64 rx_records;
+    u64 tx_urbs;
+    u64 tx_urb_bytes;
+    u64 tx_frames;
+    u64 tx_submit_errors;
+    u64 tx_urb_errors;
+    u64 tx_queue_stops;
+    u64 tx_busy;
+};
+
+// device wide transport counters for ethtool -S, shown on every channel
+struct rexgen_usb_xstats {
+    u64 rx_urbs;
+    u64 rx_urb_bytes;
+    u64 rx_urb_errors;
+    u64 rx_resubmit_errors;
+    u64 rx_blocks;
+    u64 rx_block_aborts;
+    u64 rx_records;
+    u64 rx_records_truncated;
+    u64 rx_records_can;
+    u64 rx_records_err;
+    u64 rx_records_unknown;
+    u64 cmd_sent;
+    u64 cmd_timeouts;
+    u64 cmd_errors;
+};
+
+// per-channel log2 latency histograms, bucket i counts [2^i, 2^(i+1)) ns
+enum rexgen_hist_id {
+    REXGEN_HIST_RX_USB,     // device timestamp to URB completion
+    REXGEN_HIST_RX_STACK,   // URB completion to netif_receive_skb
+    REXGEN_HIST_TX_CONFIRM, // on_xmit to the device TX confirmation
+    REXGEN_HIST_COUNT,
+};
+
+#define REXGEN_HIST_BUCKETS         32
+
+struct rexgen_hist {
+    u64 count;
+    u64 sum;
+    u64 min;
+    u64 max;
+    u64 buckets[REXGEN_HIST_BUCKETS];
+};
+
+struct rexgen_net_hist {
+    struct rexgen_hist hist[REXGEN_HIST_COUNT];
+};
+
+extern bool rexgen_latency_hist;
+
+struct usb_tx_echo {
+    canid_t can_id; // CAN_EFF_FLAG and id, as confirmed by the device
+    unsigned char len;
+    bool failed;    // its transfer never reached the device, see echo_tx_failed()
+    u64 xmit_ns;    // for REXGEN_HIST_TX_CONFIRM, 0 when not sampled
+};
 
 struct usb_tx_context {
     struct rexgen_net *net;
-    u32 echo_index;
+    u32 echo_index; // echo slot of the first frame
+    u16 queue;      // TX queue all frames of the transfer came from
+    unsigned int data_len; // CAN payload bytes, cyclic transfers only
+    bool echoed;    // echo slots are released by tx_confirm, not the completion
     int dlc;
+
+    // preallocated at open, recycled on completion
+    struct urb *urb;
+    void *buf;
+    dma_addr_t buf_dma;
+    unsigned int frames;
+    unsigned int len;
 };
 
+// command templates, the per-call arguments (channel, ...) are copied over
+// cmd_data[2] onwards when the command is built in its slot
 typedef struct 
 {
     uint32_t tx_len;
@@ -127,20 +281,20 @@ static const cmd_struct cmdGetFwVersion = {2, 15, {USB_CMD_GET_FW_VERSION, 0x00}
 static const cmd_struct cmdCANBusCount = {2, 7, {USB_CMD_CAN_BUS_COUNT, 0x00}};
 static const cmd_struct cmdCANIntfEnable = {2, 10, {USB_CMD_CAN_INTERFACE_ENABLE, 0x00}};
 static const cmd_struct cmdCANIntfDisable = {2, 10, {USB_CMD_CAN_INTERFACE_DISABLE, 0x00}};
-static cmd_struct cmdCANBlockUIDGet = {5, 10, {USB_CMD_CAN_BLOCK_UID_GET, 0x00, 0, 0, 0}};
-static cmd_struct cmdCANParamSet = {12, 10, {USB_CMD_CAN_PARAM_SET, 0x00, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}};
-static cmd_struct cmdCANDataParamSet = {12, 10, {USB_CMD_CAN_DATA_PARAM_SET, 0x00, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}};
-static cmd_struct cmdCANBusOpen = {5, 10, {USB_CMD_CAN_BUS_OPEN, 0x00, 0, 0, CAN_INTERFACE_LISTENONLY}};
-static cmd_struct cmdCANBusClose = {5, 10, {USB_CMD_CAN_BUS_CLOSE, 0x00, 0, 0}};
-static cmd_struct cmdCANBusOn = {4, 10, {USB_CMD_CAN_BUS_ON, 0x00, 0, 0}};
-static cmd_struct cmdCANBusOff = {4, 10, {USB_CMD_CAN_BUS_OFF, 0x00, 0, 0}};
+static const cmd_struct cmdCANBlockUIDGet = {5, 10, {USB_CMD_CAN_BLOCK_UID_GET, 0x00, 0, 0, 0}};
+static const cmd_struct cmdCANParamSet = {12, 10, {USB_CMD_CAN_PARAM_SET, 0x00, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}};
+static const cmd_struct cmdCANDataParamSet = {12, 10, {USB_CMD_CAN_DATA_PARAM_SET, 0x00, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}};
+static const cmd_struct cmdCANBusOpen = {5, 10, {USB_CMD_CAN_BUS_OPEN, 0x00, 0, 0, CAN_INTERFACE_LISTENONLY}};
+static const cmd_struct cmdCANBusClose = {5, 10, {USB_CMD_CAN_BUS_CLOSE, 0x00, 0, 0}};
+static const cmd_struct cmdCANBusOn = {4, 10, {USB_CMD_CAN_BUS_ON, 0x00, 0, 0}};
+static const cmd_struct cmdCANBusOff = {4, 10, {USB_CMD_CAN_BUS_OFF, 0x00, 0, 0}};
 static const cmd_struct cmmdUSBStartLiveData = {3, 7, {USB_CMD_START_LIVE_DATA, 0x00, 0x00}}; //Third Param is Channel 
 static const cmd_struct cmmdUSBStopLiveData = {3, 7, {USB_CMD_STOP_LIVE_DATA, 0x00, 0}};  //Third Param is Channel
 static const cmd_struct cmmdUSBGetLiveData = {3, 16, {USB_CMD_GET_LIVE_DATA, 0x00, 0}};  //Third Param is Channel
 
 struct usb_config {
     const struct can_clock clock;
-    const unsigned int timestamp_freq;
+    const unsigned int timestamp_freq; // device timestamp counter, MHz
     const struct can_bittiming_const * const bittiming_const;
     const struct can_bittiming_const * const data_bittiming_const;
 };
@@ -168,32 +322,108 @@ static const struct usb_config rex_usb_cfg =
     .data_bittiming_const = &bittiming_def,
 };
 
-struct rexgen_cmd {
-    unsigned long Timeout;
-    unsigned long tx_len;
-    unsigned long rx_len;
-    unsigned char tx_data[2 * USB_TRANSFER_BLOCK_SIZE];
-    unsigned char rx_data[2 * USB_TRANSFER_BLOCK_SIZE];
+// one command in flight on the bulk command endpoints, the response is matched
+// to the slot by the sequence byte
+struct usb_cmd_slot {
+    struct rexgen_usb *dev;
+    struct urb *urb;
+    unsigned char *tx_data;
+    unsigned char *rx_data;
+    unsigned int tx_len;
+    unsigned int rx_len;
+
+    unsigned char seq;
+    unsigned int order; // submission order, for firmware without sequence echo
+    u64 sent_ns;        // for the response time in the command tracepoints
+    bool busy;          // owned by a caller
+    bool pending;       // waiting for the response
+    int status;
+    struct completion done;
+};
+
+struct rexgen_usb;
+struct rexgen_net;
+
+typedef void (*rexgen_rec_handler)(struct rexgen_usb *dev, struct rexgen_net *net, usb_record *rec);
+
+// live data block UID of a channel and what to do with its records
+struct rexgen_uid_entry {
+    u16 uid;
+    u8 kind;        // IDX_CAN_BLOCK_UID_*
+    bool used;
+    struct rexgen_net *net;
+    rexgen_rec_handler handler;
 };
 
 struct rexgen_usb {
     struct usb_device *udev;
     struct usb_interface *intf;
-    struct rexgen_net *nets[USB_MAX_NET_DEVICES];
+    struct rexgen_net **nets;   // nchannels entries, allocated once the count is known
+
+    // record dispatch by block UID, open addressing and at most half full;
+    // built at probe once the block UIDs are read, read-only afterwards
+    struct rexgen_uid_entry *uid_table;
+    unsigned int uid_bits;
 
     struct usb_endpoint_descriptor *bulk_in, *bulk_out; 
     struct usb_endpoint_descriptor *live_in, *live_out; 
     struct usb_anchor rx_submitted;
+    struct usb_anchor rx_halted; // completed with -EPIPE, wait for rx_halt_work
+    struct work_struct rx_halt_work;
+    bool rx_stopping;
 
+    // read once at probe, see the sysfs attributes of the USB interface
     unsigned char fw_ver[4];
     unsigned char nchannels;    
-
-    unsigned char usb_rx_data[2 * USB_TRANSFER_BLOCK_SIZE];
-    unsigned char usb_rx_len;
+    bool sysfsdone;
+
+    // asynchronous command engine, cmd_lock protects the slot states and the
+    // sequence counter; nothing is shared between devices
+    spinlock_t cmd_lock;
+    wait_queue_head_t cmd_wq;
+    struct usb_cmd_slot cmd_slots[USB_CMD_SLOTS];
+    unsigned char cmd_seq;
+    unsigned int cmd_order;
+    unsigned int cmd_seq_matches; // see USB_CMD_SEQ_MATCHES
+    struct urb *cmd_rx_urb;
+    unsigned char *cmd_rx_buf;
+    struct work_struct cmd_halt_work; // clears a stall of the response endpoint
 
     bool rxinitdone;
+    unsigned int rx_urb_count;
+    unsigned int rx_buffer_size;
     void *rxbuf[USB_MAX_RX_URBS];
     dma_addr_t rxbuf_dma[USB_MAX_RX_URBS];
+
+    // completed live data URBs waiting for the NAPI poll
+    bool napienabled;
+    struct napi_struct napi;
+    spinlock_t rx_done_lock;
+    struct urb *rx_done[USB_MAX_RX_URBS];
+    u64 rx_done_ns[USB_MAX_RX_URBS];      // completion time, monotonic
+    u64 rx_done_real_ns[USB_MAX_RX_URBS]; // and in the clock of the device timestamps
+    unsigned int rx_done_head, rx_done_tail;
+    u64 rx_urb_ns, rx_urb_real_ns;        // of the URB being parsed
+    unsigned int rx_block, rx_pos; // parse position inside the oldest URB
+
+    // CPU running the NAPI poll, -1 for the CPU the URB completed on;
+    // rx_ipi is set while the IPI scheduling the poll there is in flight
+    int rx_cpu;
+    call_single_data_t rx_csd;
+    unsigned long rx_ipi;
+
+    struct rexgen_usb_xstats __percpu *xstats;
+    struct dentry *debugfs;
+
+    // device timestamps extended to 64 bit ns; ts_lock serialises the NAPI poll
+    // and ts_work, which moves the base on while no record arrives
+    bool tcinitdone;
+    u32 ts_last;
+    unsigned long ts_last_jiffies;
+    spinlock_t ts_lock;
+    struct delayed_work ts_work;
+    struct cyclecounter cc;
+    struct timecounter tc;
 };
 
 struct rexgen_net {
@@ -204,54 +434,173 @@ struct rexgen_net {
     struct net_device *netdev;
     int channel;
     unsigned int usb_block_uid[3]; 
-    
+
+    struct rexgen_pcpu_stats __percpu *stats;
+    struct rexgen_net_hist __percpu *hist;
+
+    // NULL accepts all frames, rx_filtered is only written by the NAPI poll
+    struct rexgen_filter __rcu *filter;
+    u64 rx_filtered;
+
+    // NULL queues all frames by skb->priority
+    struct rexgen_txq_map __rcu *txq_map;
+
+    // error frames sent in the current one second window, NAPI poll only
+    unsigned long err_window;
+    unsigned int err_count;
+
+    // CAN_PARAM_SET arguments the device was last configured with, the timings
+    // staged in can.bittiming / can.data_bittiming are only sent when they differ
+    unsigned char bt_args[RexBittimingArgsLength];
+    unsigned char dbt_args[RexBittimingArgsLength];
+    bool bt_valid, dbt_valid;
 
     struct completion start_comp, stop_comp, flush_comp;
     struct usb_anchor tx_submitted;
     
-    struct sk_buff *echoskb;
-    spinlock_t tx_contexts_lock;
-    int active_tx_contexts;
+    // frames collected for the next live data TX transfer; tx_lock serialises
+    // on_xmit of the TX queues, the completions only advance the tails
+    spinlock_t tx_lock;
+    struct usb_tx_context *tx_context;
+    unsigned int tx_len;
+
+    // one echo slot per frame in flight: on_xmit takes them at echo_head, they are
+    // released at echo_tail by the device TX confirmation (DIR records, loopback
+    // mode) or otherwise by the URB completion; in loopback mode cyclic frames
+    // take slots without skb so that the confirmations stay in send order
+    bool echo_confirmed;
+    bool echo_failed; // failed slots wait for the NAPI poll
+    bool hwts_tx;
+    unsigned int echo_head;
+    unsigned int echo_tail;
+    struct usb_tx_echo tx_echo[USB_MAX_TX_ECHO];
+
+    // cyclic transmit table, changed under rtnl and cyc_lock and sent from
+    // cyc_timer in transfers of their own, cyc_busy marks those in flight
+    spinlock_t cyc_lock;
+    struct hrtimer cyc_timer;
+    struct rexgen_cyclic *cyc; // USB_MAX_CYCLIC entries, allocated on first use
+    unsigned int cyc_count;
+    unsigned long cyc_busy;
+
+    // tx_contexts are used as a ring: on_xmit takes them at tx_head, the completion
+    // returns them at tx_tail, live data URBs complete in submission order; the
+    // USB_CYCLIC_URBS after the ring belong to the cyclic transfers
+    unsigned int tx_head;
+    unsigned int tx_tail;
     struct usb_tx_context tx_contexts[];
 };
 
-#define RexRecordMaxInfLength  28
-#define RexRecordMaxCanLength  64
-typedef struct {
-    unsigned short uid;
-    unsigned char infsize;
-    unsigned char dlc;
+static inline const struct rexgen_uid_entry *rexgen_uid_lookup(const struct rexgen_usb *dev, u16 uid)
+{
+    unsigned int mask = (1U << dev->uid_bits) - 1;
+    unsigned int i;
+
+    if (!dev->uid_table)
+        return NULL;
+
+    for (i = hash_32(uid, dev->uid_bits); dev->uid_table[i].used; i = (i + 1) & mask)
+        if (dev->uid_table[i].uid == uid)
+            return &dev->uid_table[i];
+
+    return NULL;
+}
+
+static inline void rexgen_rx_stats(struct rexgen_net *net, unsigned int packets,
+        unsigned int bytes, unsigned int dropped, unsigned int errors, unsigned int over_errors)
+{
+    struct rexgen_pcpu_stats *stats = this_cpu_ptr(net->stats);
+
+    u64_stats_update_begin(&stats->rx_syncp);
+    stats->rx_packets += packets;
+    stats->rx_bytes += bytes;
+    stats->rx_dropped += dropped;
+    stats->rx_errors += errors;
+    stats->rx_over_errors += over_errors;
+    u64_stats_update_end(&stats->rx_syncp);
+}
+
+static inline void rexgen_tx_stats(struct rexgen_net *net, unsigned int packets,
+        unsigned int bytes, unsigned int dropped, unsigned int errors)
+{
+    struct rexgen_pcpu_stats *stats;
+    unsigned long flags;
+
+    // URB completions may interrupt the NAPI poll on the same CPU
+    local_irq_save(flags);
+    stats = this_cpu_ptr(net->stats);
+    u64_stats_update_begin(&stats->tx_syncp);
+    stats->tx_packets += packets;
+    stats->tx_bytes += bytes;
+    stats->tx_dropped += dropped;
+    stats->tx_errors += errors;
+    u64_stats_update_end(&stats->tx_syncp);
+    local_irq_restore(flags);
+}
+
+// NAPI poll only
+static inline void rexgen_hist_add(struct rexgen_net *net, enum rexgen_hist_id id, s64 delta)
+{
+    struct rexgen_hist *hist = &this_cpu_ptr(net->hist)->hist[id];
+    u64 ns = delta > 0 ? delta : 0;
+
+    hist->buckets[min_t(unsigned int, ns ? ilog2(ns) : 0, REXGEN_HIST_BUCKETS - 1)]++;
+    if (!hist->count || ns < hist->min)
+        hist->min = ns;
+    if (ns > hist->max)
+        hist->max = ns;
+    hist->count++;
+    hist->sum += ns;
+}
 
-    unsigned char inf[RexRecordMaxInfLength];
-    unsigned char data[RexRecordMaxCanLength];
-} usb_record;
 
 
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
-void printkBuffer(void *data, int len, char* prefix);
-void printkrx(struct rexgen_cmd* cmd);
-void printkrxusb(struct rexgen_usb *dev);
-void printktx(struct rexgen_cmd * cmd);
-void printkLiveData(void *buff, int len);
+int usb_cmd_init(struct rexgen_usb *dev);
+void usb_cmd_cleanup(struct rexgen_usb *dev);
+struct usb_cmd_slot *usb_cmd_submit(struct rexgen_usb *dev, const cmd_struct *cmdstruct,
+        const unsigned char *args, unsigned int nargs);
+int usb_cmd_wait(struct usb_cmd_slot *slot);
+void usb_cmd_release(struct usb_cmd_slot *slot);
 
 int usb_get_firmware(struct rexgen_usb *dev);
 int usb_get_num_channels(struct rexgen_usb *dev);
 int usb_can_intf_enable(struct rexgen_usb *dev);
+bool err_records_supported(struct rexgen_usb *dev);
 int usb_can_intf_disable(struct rexgen_usb *dev);
 int usb_set_bittiming(struct net_device *netdev);
 int usb_set_data_bittiming(struct net_device *netdev);
 int usb_bus_start(struct rexgen_usb_net_priv *priv);
 int usb_start_live_data(struct rexgen_usb *dev);
 int usb_stop_live_data(struct rexgen_usb *dev);
-int usb_can_bus_open(struct rexgen_usb *dev, unsigned short channel, unsigned char flags);
+int usb_can_bus_start(struct rexgen_net *net, unsigned char flags);
 int usb_can_bus_close(struct rexgen_usb *dev, unsigned short channel);
 int usb_can_bus_on(struct rexgen_usb *dev, unsigned short channel);
 int usb_can_bus_off(struct rexgen_usb *dev, unsigned short channel);
 
-unsigned short livedata_size(void *buff, int len);
-int ptr2rec(usb_record *rec, void *buff);
-void can2socket(struct rexgen_usb *dev, usb_record *rec);
+void usb_init_timestamp(struct rexgen_usb *dev);
+void usb_stop_timestamp(struct rexgen_usb *dev);
+u64 usb_timestamp_to_ns(struct rexgen_usb *dev, u32 timestamp);
+
+void rexgen_debugfs_init(void);
+void rexgen_debugfs_exit(void);
+void rexgen_debugfs_add_device(struct rexgen_usb *dev);
+void rexgen_debugfs_remove_device(struct rexgen_usb *dev);
+
+extern struct device_attribute dev_attr_tx_cyclic;
+void rexgen_cyclic_init(struct rexgen_net *net);
+void rexgen_cyclic_start(struct rexgen_net *net);
+void rexgen_cyclic_stop(struct rexgen_net *net);
+void rexgen_cyclic_free(struct rexgen_net *net);
+void rexgen_cyclic_callback(struct urb *urb);
+
+void can2socket(struct rexgen_usb *dev, struct rexgen_net *net, usb_record *rec);
+void err2socket(struct rexgen_usb *dev, struct rexgen_net *net, usb_record *rec);
+void tx_confirm(struct rexgen_net *net, canid_t canid, u64 ns);
+bool echo_cyclic_frame(struct rexgen_net *net, canid_t canid, unsigned char len);
+void echo_tx_failed(struct rexgen_net *net, unsigned int echo_index, unsigned int frames);
+void reap_tx_echo(struct rexgen_net *net);
 
 #endif //rexgen_usb_H_
@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: GPL-2.0
+/* 
+    USB to SocketCAN driver for ReXgen
+    Copyright (C) 1999-2021 Influx Technology LTD, UK. All rights reserved.
+    Contacts: https://www.influxtechnology.com/contact
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Latency histograms under debugfs:
+//     <debugfs>/rexgen/<usb interface>/ch<n>/latency
+// reading prints a summary and the non-empty buckets, writing anything resets them
+
+#include <linux/version.h>
+#include "rexgen_def.h"
+
+static struct dentry *rexgen_debugfs_root;
+
+static const char * const rexgen_hist_names[REXGEN_HIST_COUNT] = {
+    [REXGEN_HIST_RX_USB] = "rx_usb",
+    [REXGEN_HIST_RX_STACK] = "rx_stack",
+    [REXGEN_HIST_TX_CONFIRM] = "tx_confirm",
+};
+
+static void hist_sum(const struct rexgen_net *net, enum rexgen_hist_id id, struct rexgen_hist *sum)
+{
+    int cpu, i;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu)
+    {
+        const struct rexgen_hist *hist = &per_cpu_ptr(net->hist, cpu)->hist[id];
+
+        if (!hist->count)
+            continue;
+
+        if (!sum->count || hist->min < sum->min)
+            sum->min = hist->min;
+        if (hist->max > sum->max)
+            sum->max = hist->max;
+        sum->count += hist->count;
+        sum->sum += hist->sum;
+        for (i = 0; i < REXGEN_HIST_BUCKETS; i++)
+            sum->buckets[i] += hist->buckets[i];
+    }
+}
+
+// upper bound of the bucket holding the given per mille, capped at the maximum
+static u64 hist_percentile(const struct rexgen_hist *hist, unsigned int permille)
+{
+    u64 target = div_u64(hist->count * permille + 999, 1000);
+    u64 seen = 0;
+    int i;
+
+    for (i = 0; i < REXGEN_HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen >= target)
+            return min_t(u64, 2ULL << i, hist->max);
+    }
+
+    return hist->max;
+}
+
+static int latency_show(struct seq_file *m, void *v)
+{
+    const struct rexgen_net *net = m->private;
+    struct rexgen_hist hist;
+    int id, i;
+
+    for (id = 0; id < REXGEN_HIST_COUNT; id++)
+    {
+        hist_sum(net, id, &hist);
+
+        seq_printf(m, "%s: count %llu", rexgen_hist_names[id], hist.count);
+        if (hist.count)
+            seq_printf(m, " min %llu avg %llu max %llu p50 %llu p90 %llu p99 %llu p99.9 %llu",
+                    hist.min, div64_u64(hist.sum, hist.count), hist.max,
+                    hist_percentile(&hist, 500), hist_percentile(&hist, 900),
+                    hist_percentile(&hist, 990), hist_percentile(&hist, 999));
+        seq_puts(m, " ns\n");
+
+        for (i = 0; i < REXGEN_HIST_BUCKETS; i++)
+            if (hist.buckets[i])
+                seq_printf(m, "  %12llu - %12llu: %llu\n",
+                        i ? 1ULL << i : 0ULL, (2ULL << i) - 1, hist.buckets[i]);
+    }
+
+    return 0;
+}
+
+static int latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, latency_show, inode->i_private);
+}
+
+static ssize_t latency_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct rexgen_net *net = file_inode(file)->i_private;
+    int cpu;
+
+    // a frame counted concurrently may be lost, that is fine for a reset
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(net->hist, cpu), 0, sizeof(struct rexgen_net_hist));
+
+    return count;
+}
+
+static const struct file_operations latency_fops = {
+    .owner = THIS_MODULE,
+    .open = latency_open,
+    .read = seq_read,
+    .write = latency_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+void rexgen_debugfs_init(void)
+{
+    rexgen_debugfs_root = debugfs_create_dir("rexgen", NULL);
+}
+
+void rexgen_debugfs_exit(void)
+{
+    debugfs_remove_recursive(rexgen_debugfs_root);
+}
+
+void rexgen_debugfs_add_device(struct rexgen_usb *dev)
+{
+    struct dentry *dir;
+    char name[16];
+    int i;
+
+    dev->debugfs = debugfs_create_dir(dev_name(&dev->intf->dev), rexgen_debugfs_root);
+
+    for (i = 0; i < dev->nchannels; i++)
+    {
+        if (!dev->nets[i])
+            continue;
+
+        snprintf(name, sizeof(name), "ch%d", i);
+        dir = debugfs_create_dir(name, dev->debugfs);
+        debugfs_create_file("latency", 0644, dir, dev->nets[i], &latency_fops);
+    }
+}
+
+void rexgen_debugfs_remove_device(struct rexgen_usb *dev)
+{
+    debugfs_remove_recursive(dev->debugfs);
+    dev->debugfs = NULL;
+}
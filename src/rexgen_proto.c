@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: GPL-2.0
+/* 
+    USB to SocketCAN driver for ReXgen
+    Copyright (C) 1999-2021 Influx Technology LTD, UK. All rights reserved.
+    Contacts: https://www.influxtechnology.com/contact
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "rexgen_proto.h"
+
+// Size of the live data block at buff including its length field, 0 when
+// not even the length field fits into len
+unsigned int livedata_size(const void *buff, unsigned int len)
+{
+    if (len < 2)
+        return 0;
+
+    return get_unaligned_le16(buff) + 2;
+}
+
+// Maps a record in place, returns its size or 0 when it does not fit into len
+int ptr2rec(usb_record *rec, const void *buff, int len)
+{
+    const unsigned char *ptr = buff;
+    int size;
+
+    if (len < RexRecordHeaderLength)
+        return 0;
+
+    rec->uid = get_unaligned_le16(ptr);
+    rec->infsize = ptr[2];
+    rec->dlc = ptr[3];
+
+    size = RexRecordHeaderLength + rec->infsize + rec->dlc;
+    if (size > len)
+        return 0;
+
+    rec->inf = ptr + RexRecordHeaderLength;
+    rec->data = rec->inf + rec->infsize;
+
+    return size;
+}
+
+// Encodes a CAN frame as a live data record, returns its size
+int frame2rec(void *buff, unsigned short uid, unsigned int canid, unsigned char canflags,
+              const void *data, unsigned char len)
+{
+    unsigned char *ptr = buff;
+
+    // Header
+    put_unaligned_le16(uid, ptr);
+    ptr[2] = RexRecordCanInfLength;
+    ptr[3] = len;
+    // Inf data, the timestamp is set by the device
+    put_unaligned_le32(0, ptr + 4);
+    put_unaligned_le32(canid, ptr + 8);
+    ptr[12] = canflags;
+    // Can data
+    memcpy(ptr + 13, data, len);
+
+    return RexRecordHeaderLength + RexRecordCanInfLength + len;
+}
+
+// Advances *block / *pos over the live data blocks in buff and reports what was
+// found. Every block length and record size is checked against len before it
+// is used, so a corrupted transfer can only end the walk early.
+enum rexgen_walk rexgen_walk_next(const void *buff, unsigned int len,
+                                  unsigned int *block, unsigned int *pos, usb_record *rec)
+{
+    const unsigned char *ptr = buff;
+    unsigned int size;
+    int rec_size;
+
+    while (*block < len)
+    {
+        size = livedata_size(ptr + *block, len - *block);
+        if (size < 2 || size > len - *block)
+        {
+            *block = len;
+            *pos = 0;
+            return REXGEN_WALK_BAD_BLOCK;
+        }
+
+        if (!*pos)
+        {
+            *pos = 2;
+            return REXGEN_WALK_BLOCK;
+        }
+
+        if (*pos < size)
+        {
+            rec_size = ptr2rec(rec, ptr + *block + *pos, size - *pos);
+            if (rec_size)
+            {
+                *pos += rec_size;
+                return REXGEN_WALK_RECORD;
+            }
+
+            *block += size;
+            *pos = 0;
+            return REXGEN_WALK_TRUNCATED;
+        }
+
+        *block += size;
+        *pos = 0;
+    }
+
+    return REXGEN_WALK_END;
+}
+
+// Stores the sum of data[0..count - 2] in the last byte
+void build_check_sum(unsigned char *data, unsigned short count)
+{
+    int i;
+    unsigned char *crc = data + count - 1;
+
+    *crc = 0;
+    for (i = 0; i < count - 1; i++)
+        *crc += data[i];
+}
+
+// Lays out a command frame in buff from the template cmd and the per-call
+// arguments, returns the frame length. The sequence byte and the checksum
+// are left for the sender, buff must hold cmd_len + RexCmdFrameOverhead bytes.
+unsigned short build_cmd_frame(unsigned char *buff, const unsigned char *cmd, unsigned short cmd_len,
+                               const unsigned char *args, unsigned int nargs)
+{
+    unsigned short len = cmd_len + RexCmdFrameOverhead;
+
+    put_unaligned_le16(len, &buff[1]);
+    memcpy(&buff[3], cmd, cmd_len);
+    if (args && cmd_len > 2)
+        memcpy(&buff[RexCmdArgsOffset], args, nargs < cmd_len - 2u ? nargs : cmd_len - 2u);
+
+    return len;
+}
+
+// Encodes a bit timing as CAN_PARAM_SET arguments, prop_seg and phase_seg1
+// go to the device as one tseg1
+void bittiming2args(unsigned char *args, unsigned short channel, u32 bitrate,
+                    u32 tseg1, u32 tseg2, u32 sjw, u32 brp)
+{
+    put_unaligned_le16(channel, &args[0]);
+    put_unaligned_le32(bitrate, &args[2]);
+    args[6] = tseg1;
+    args[7] = tseg2;
+    args[8] = sjw;
+    args[9] = brp;
+}
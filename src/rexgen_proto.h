@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: GPL-2.0
+/* 
+    USB to SocketCAN driver for ReXgen
+    Copyright (C) 1999-2021 Influx Technology LTD, UK. All rights reserved.
+    Contacts: https://www.influxtechnology.com/contact
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+// Live data framing shared by the driver and the userspace build (make proto).
+// Only byte manipulation lives here, no kernel objects.
+
+#ifndef rexgen_proto_H_
+#define rexgen_proto_H_
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#include <linux/version.h>
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0))
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+#else
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+
+static inline u16 get_unaligned_le16(const void *p)
+{
+    const u8 *b = p;
+
+    return b[0] | b[1] << 8;
+}
+
+static inline u32 get_unaligned_le32(const void *p)
+{
+    const u8 *b = p;
+
+    return b[0] | b[1] << 8 | b[2] << 16 | (u32)b[3] << 24;
+}
+
+static inline void put_unaligned_le16(u16 v, void *p)
+{
+    u8 *b = p;
+
+    b[0] = v;
+    b[1] = v >> 8;
+}
+
+static inline void put_unaligned_le32(u32 v, void *p)
+{
+    u8 *b = p;
+
+    b[0] = v;
+    b[1] = v >> 8;
+    b[2] = v >> 16;
+    b[3] = v >> 24;
+}
+#endif
+
+// CAN DataFrame Flags
+#define DataFrame_IDE  1  // Identifier extension bit
+#define DataFrame_SRR  2  // Substitute remote request
+#define DataFrame_EDL  4  // Extended data length
+#define DataFrame_BRS  8  // Bit rate switch
+#define DataFrame_DIR 16  // Frame direction - 0: Rx, 1:Tx
+
+// CAN error records of the ERR block: timestamp, status, last error code, TEC, REC.
+// This layout and the values below are assumed, they are not checked against a
+// firmware specification; the driver only decodes them on firmware selected with
+// the err_records_fw module parameter.
+#define ErrFrame_WARNING     1  // an error counter reached 96
+#define ErrFrame_PASSIVE     2  // an error counter reached 128
+#define ErrFrame_BUSOFF      4  // TEC reached 256
+#define ErrFrame_RX_OVERFLOW 8  // the controller lost received frames
+
+#define ErrCode_NONE  0
+#define ErrCode_STUFF 1
+#define ErrCode_FORM  2
+#define ErrCode_ACK   3
+#define ErrCode_BIT1  4
+#define ErrCode_BIT0  5
+#define ErrCode_CRC   6
+
+#define RexRecordHeaderLength  4
+#define RexRecordCanInfLength  9  // timestamp, CAN id, flags
+#define RexRecordErrInfLength  8  // timestamp, status, error code, TEC, REC
+#define RexRecordMaxCanLength  64
+#define RexRecordMaxLength     (RexRecordHeaderLength + RexRecordCanInfLength + RexRecordMaxCanLength)
+
+// view of a live data record, inf and data point into the URB buffer
+typedef struct {
+    unsigned short uid;
+    unsigned char infsize;
+    unsigned char dlc;
+
+    const unsigned char *inf;
+    const unsigned char *data;
+} usb_record;
+
+// Command frame: sequence byte, 16 bit length, command bytes, checksum
+#define RexCmdFrameOverhead    4
+#define RexCmdArgsOffset       5  // per-call arguments overwrite the template from cmd_data[2]
+
+// Arguments of CAN_PARAM_SET / CAN_DATA_PARAM_SET
+#define RexBittimingArgsLength 10
+
+// Result of one rexgen_walk_next() step over a live data buffer
+enum rexgen_walk {
+    REXGEN_WALK_END,        // buffer consumed
+    REXGEN_WALK_BLOCK,      // entered a new block
+    REXGEN_WALK_RECORD,     // rec maps the next record
+    REXGEN_WALK_BAD_BLOCK,  // block length outside the buffer, rest of the buffer dropped
+    REXGEN_WALK_TRUNCATED,  // record overruns its block, rest of the block dropped
+};
+
+unsigned int livedata_size(const void *buff, unsigned int len);
+int ptr2rec(usb_record *rec, const void *buff, int len);
+int frame2rec(void *buff, unsigned short uid, unsigned int canid, unsigned char canflags,
+              const void *data, unsigned char len);
+enum rexgen_walk rexgen_walk_next(const void *buff, unsigned int len,
+                                  unsigned int *block, unsigned int *pos, usb_record *rec);
+
+void build_check_sum(unsigned char *data, unsigned short count);
+unsigned short build_cmd_frame(unsigned char *buff, const unsigned char *cmd, unsigned short cmd_len,
+                               const unsigned char *args, unsigned int nargs);
+void bittiming2args(unsigned char *args, unsigned short channel, u32 bitrate,
+                    u32 tseg1, u32 tseg2, u32 sjw, u32 brp);
+
+#endif
@@ -0,0 +1,262 @@
+// SPDX-License-Identifier: GPL-2.0
+/* 
+    USB to SocketCAN driver for ReXgen
+    Copyright (C) 1999-2021 Influx Technology LTD, UK. All rights reserved.
+    Contacts: https://www.influxtechnology.com/contact
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// KUnit tests of rexgen_proto.c: the live data walker, record and command
+// framing and the bit timing arguments. Built into the module with
+// CONFIG_CAN_REXGEN_USB_KUNIT_TEST=y (make kunit), the suite runs when the
+// module is loaded into a kernel with KUnit.
+
+#include <kunit/test.h>
+#include <linux/version.h>
+#include "rexgen_def.h"
+
+#ifndef KUNIT_EXPECT_MEMEQ
+#define KUNIT_EXPECT_MEMEQ(test, left, right, size) KUNIT_EXPECT_EQ(test, memcmp(left, right, size), 0)
+#endif
+
+// appends a block holding the given records, returns the new length
+static unsigned int add_block(unsigned char *buff, unsigned int len,
+                              const unsigned char *dlcs, unsigned int count)
+{
+    static const unsigned char data[RexRecordMaxCanLength] = { 0x11, 0x22, 0x33 };
+    unsigned int block = len, i;
+
+    len += 2;
+    for (i = 0; i < count; i++)
+        len += frame2rec(buff + len, 100 + i, 0x123 + i, 0, data, dlcs[i]);
+    put_unaligned_le16(len - block - 2, buff + block);
+
+    return len;
+}
+
+static void rexgen_walk_records(struct kunit *test)
+{
+    static const unsigned char first[] = { 8, 0 }, second[] = { 64 };
+    unsigned char buff[256];
+    unsigned int len, block = 0, pos = 0;
+    usb_record rec;
+
+    len = add_block(buff, 0, first, ARRAY_SIZE(first));
+    len = add_block(buff, len, second, ARRAY_SIZE(second));
+
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_BLOCK);
+    KUNIT_ASSERT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_RECORD);
+    KUNIT_EXPECT_EQ(test, rec.uid, 100);
+    KUNIT_EXPECT_EQ(test, rec.infsize, RexRecordCanInfLength);
+    KUNIT_EXPECT_EQ(test, rec.dlc, 8);
+    KUNIT_EXPECT_EQ(test, get_unaligned_le32(rec.inf + 4), 0x123);
+    KUNIT_EXPECT_EQ(test, rec.data[1], 0x22);
+    KUNIT_EXPECT_PTR_EQ(test, rec.inf, (const unsigned char *)buff + 2 + RexRecordHeaderLength);
+
+    KUNIT_ASSERT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_RECORD);
+    KUNIT_EXPECT_EQ(test, rec.uid, 101);
+    KUNIT_EXPECT_EQ(test, rec.dlc, 0);
+
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_BLOCK);
+    KUNIT_ASSERT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_RECORD);
+    KUNIT_EXPECT_EQ(test, rec.dlc, 64);
+    KUNIT_EXPECT_PTR_EQ(test, rec.data + rec.dlc, (const unsigned char *)buff + len);
+
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_END);
+    KUNIT_EXPECT_EQ(test, block, len);
+}
+
+static void rexgen_walk_empty_block(struct kunit *test)
+{
+    unsigned char buff[2] = { 0, 0 };
+    unsigned int block = 0, pos = 0;
+    usb_record rec;
+
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, 2, &block, &pos, &rec), REXGEN_WALK_BLOCK);
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, 2, &block, &pos, &rec), REXGEN_WALK_END);
+}
+
+// a block length past the transfer drops the rest of it, a single stray byte too
+static void rexgen_walk_bad_block(struct kunit *test)
+{
+    static const unsigned char dlcs[] = { 8 };
+    unsigned char buff[64];
+    unsigned int len, block = 0, pos = 0;
+    usb_record rec;
+
+    len = add_block(buff, 0, dlcs, ARRAY_SIZE(dlcs));
+    put_unaligned_le16(len, buff);
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_BAD_BLOCK);
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_END);
+
+    len = add_block(buff, 0, dlcs, ARRAY_SIZE(dlcs));
+    buff[len++] = 0;
+    block = 0;
+    pos = 0;
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_BLOCK);
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_RECORD);
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_BAD_BLOCK);
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_END);
+}
+
+// a record overrunning its block drops the rest of the block, not the transfer
+static void rexgen_walk_truncated(struct kunit *test)
+{
+    static const unsigned char dlcs[] = { 8 };
+    unsigned char buff[64];
+    unsigned int len, block = 0, pos = 0;
+    usb_record rec;
+
+    len = add_block(buff, 0, dlcs, ARRAY_SIZE(dlcs));
+    put_unaligned_le16(get_unaligned_le16(buff) - 2, buff);
+    put_unaligned_le16(0, buff + len - 2); // the cut off bytes become an empty block
+    len = add_block(buff, len, dlcs, ARRAY_SIZE(dlcs));
+
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_BLOCK);
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_TRUNCATED);
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_BLOCK);
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_BLOCK);
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_RECORD);
+    KUNIT_EXPECT_EQ(test, rexgen_walk_next(buff, len, &block, &pos, &rec), REXGEN_WALK_END);
+}
+
+// every cut of a valid transfer ends the walk without reading past the cut
+static void rexgen_walk_cut(struct kunit *test)
+{
+    static const unsigned char dlcs[] = { 8, 64, 0, 12 };
+    unsigned char buff[256];
+    unsigned int full, len, block, pos, steps;
+    enum rexgen_walk res;
+    usb_record rec;
+
+    full = add_block(buff, 0, dlcs, ARRAY_SIZE(dlcs));
+    full = add_block(buff, full, dlcs, 2);
+
+    for (len = 0; len <= full; len++)
+    {
+        block = 0;
+        pos = 0;
+        steps = 0;
+        do {
+            res = rexgen_walk_next(buff, len, &block, &pos, &rec);
+            if (res == REXGEN_WALK_RECORD)
+                KUNIT_EXPECT_LE(test, rec.data + rec.dlc, (const unsigned char *)buff + len);
+            KUNIT_ASSERT_LE(test, ++steps, len + 1);
+        } while (res != REXGEN_WALK_END);
+    }
+}
+
+static void rexgen_frame2rec(struct kunit *test)
+{
+    static const unsigned char data[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    unsigned char buff[RexRecordMaxLength];
+    usb_record rec;
+    int len;
+
+    len = frame2rec(buff, 0x1234, 0x1abcdef0, DataFrame_IDE | DataFrame_BRS, data, sizeof(data));
+    KUNIT_EXPECT_EQ(test, len, RexRecordHeaderLength + RexRecordCanInfLength + 8);
+
+    KUNIT_ASSERT_EQ(test, ptr2rec(&rec, buff, len), len);
+    KUNIT_EXPECT_EQ(test, rec.uid, 0x1234);
+    KUNIT_EXPECT_EQ(test, get_unaligned_le32(rec.inf), 0); // timestamp, set by the device
+    KUNIT_EXPECT_EQ(test, get_unaligned_le32(rec.inf + 4), 0x1abcdef0);
+    KUNIT_EXPECT_EQ(test, rec.inf[8], DataFrame_IDE | DataFrame_BRS);
+    KUNIT_EXPECT_MEMEQ(test, rec.data, data, sizeof(data));
+
+    KUNIT_EXPECT_EQ(test, ptr2rec(&rec, buff, len - 1), 0);
+    KUNIT_EXPECT_EQ(test, ptr2rec(&rec, buff, RexRecordHeaderLength - 1), 0);
+}
+
+static void rexgen_cmd_frame(struct kunit *test)
+{
+    static const unsigned char args[] = { 1, 0, CAN_INTERFACE_LOOPBACK };
+    unsigned char buff[USB_CMD_BUFFER_SIZE];
+    unsigned short len;
+    unsigned char sum = 0;
+    int i;
+
+    memset(buff, 0xff, sizeof(buff));
+    len = build_cmd_frame(buff, cmdCANBusOpen.cmd_data, cmdCANBusOpen.tx_len, args, sizeof(args));
+    KUNIT_ASSERT_EQ(test, len, cmdCANBusOpen.tx_len + RexCmdFrameOverhead);
+    KUNIT_EXPECT_EQ(test, get_unaligned_le16(&buff[1]), len);
+    KUNIT_EXPECT_EQ(test, buff[3], USB_CMD_CAN_BUS_OPEN);
+    KUNIT_EXPECT_EQ(test, buff[4], 0);
+    KUNIT_EXPECT_MEMEQ(test, &buff[RexCmdArgsOffset], args, sizeof(args));
+
+    buff[0] = 0x42;
+    build_check_sum(buff, len);
+    for (i = 0; i < len - 1; i++)
+        sum += buff[i];
+    KUNIT_EXPECT_EQ(test, buff[len - 1], sum);
+    KUNIT_EXPECT_EQ(test, buff[len], 0xff);
+}
+
+// arguments beyond the template are not copied, a missing one keeps the template
+static void rexgen_cmd_frame_args(struct kunit *test)
+{
+    static const unsigned char args[] = { 2, 0, 0xaa, 0xbb };
+    unsigned char buff[USB_CMD_BUFFER_SIZE];
+    unsigned short len;
+
+    memset(buff, 0xff, sizeof(buff));
+    len = build_cmd_frame(buff, cmdCANBusOn.cmd_data, cmdCANBusOn.tx_len, args, sizeof(args));
+    KUNIT_EXPECT_EQ(test, len, cmdCANBusOn.tx_len + RexCmdFrameOverhead);
+    KUNIT_EXPECT_EQ(test, buff[RexCmdArgsOffset], 2);
+    KUNIT_EXPECT_EQ(test, buff[RexCmdArgsOffset + 1], 0);
+    KUNIT_EXPECT_EQ(test, buff[RexCmdArgsOffset + 2], 0xff); // the checksum byte, untouched
+
+    len = build_cmd_frame(buff, cmdCANBusOpen.cmd_data, cmdCANBusOpen.tx_len, args, 2);
+    KUNIT_EXPECT_EQ(test, buff[RexCmdArgsOffset + 2], CAN_INTERFACE_LISTENONLY);
+
+    len = build_cmd_frame(buff, cmdGetFwVersion.cmd_data, cmdGetFwVersion.tx_len, NULL, 0);
+    KUNIT_EXPECT_EQ(test, len, 6);
+    KUNIT_EXPECT_EQ(test, buff[3], USB_CMD_GET_FW_VERSION);
+}
+
+// 500 kbit/s at 80 MHz: brp 8, prop_seg 7 + phase_seg1 8, phase_seg2 4, sjw 1
+static void rexgen_bittiming_args(struct kunit *test)
+{
+    static const unsigned char expected[RexBittimingArgsLength] = {
+        0x01, 0x00, 0x20, 0xa1, 0x07, 0x00, 15, 4, 1, 8,
+    };
+    unsigned char args[RexBittimingArgsLength];
+
+    bittiming2args(args, 1, 500000, 7 + 8, 4, 1, 8);
+    KUNIT_EXPECT_MEMEQ(test, args, expected, sizeof(expected));
+
+    // the argument block fills the CAN_PARAM_SET template exactly
+    KUNIT_EXPECT_EQ(test, cmdCANParamSet.tx_len - 2, RexBittimingArgsLength);
+    KUNIT_EXPECT_EQ(test, cmdCANDataParamSet.tx_len - 2, RexBittimingArgsLength);
+}
+
+static struct kunit_case rexgen_proto_cases[] = {
+    KUNIT_CASE(rexgen_walk_records),
+    KUNIT_CASE(rexgen_walk_empty_block),
+    KUNIT_CASE(rexgen_walk_bad_block),
+    KUNIT_CASE(rexgen_walk_truncated),
+    KUNIT_CASE(rexgen_walk_cut),
+    KUNIT_CASE(rexgen_frame2rec),
+    KUNIT_CASE(rexgen_cmd_frame),
+    KUNIT_CASE(rexgen_cmd_frame_args),
+    KUNIT_CASE(rexgen_bittiming_args),
+    {}
+};
+
+static struct kunit_suite rexgen_proto_suite = {
+    .name = "rexgen_proto",
+    .test_cases = rexgen_proto_cases,
+};
+kunit_test_suite(rexgen_proto_suite);
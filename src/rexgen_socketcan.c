@@ -26,6 +26,9 @@
 #include <linux/version.h>
 #include "rexgen_def.h"
 
+#define CREATE_TRACE_POINTS
+#include "rexgen_trace.h"
+
 MODULE_AUTHOR("Influx Technology LTD <support@influxtechnology.com>");
 MODULE_DESCRIPTION("CAN driver for RexGen CAN USB devices");
 MODULE_LICENSE("GPL v2");
@@ -33,79 +36,28 @@ MODULE_VERSION("2.11");
 MODULE_INFO(release_date, "October 14, 2022");
 MODULE_DEVICE_TABLE (usb, influx_usb_table);
 
+static unsigned int rx_urbs = USB_DEF_RX_URBS;
+module_param(rx_urbs, uint, 0444);
+MODULE_PARM_DESC(rx_urbs, "Number of live data RX URBs (1-16, default 4)");
 
-void printkBuffer(void *data, int len, char* prefix)
-{
-    if (USB_CMD_DEBUG != 1)
-        return;
-
-    char buff[255];
-    char* ptr = &buff[0];
-    int i, c = 0;
-    for (i = 0; i < len; i++)
-    {
-        ptr += sprintf(ptr, "%02X ", *((unsigned char*)(data + i)));
-        if (ptr - &buff[0] > 200)
-        {
-            c++;
-            *ptr = 0;
-            printk("%s: %s (%i) - %s", DeviceName, prefix, c, buff);
-            ptr = &buff[0];
-        }
-    }
-    *ptr = 0;
-
-    if (c > 0)
-        printk("%s: %s (%i) - %s", DeviceName, prefix, c+1, buff);
-    else
-        printk("%s: %s - %s", DeviceName, prefix, buff);
-}
-
-void printkrx(struct rexgen_cmd* cmd)
-{
-    printkBuffer(cmd->rx_data, cmd->rx_len, "RX data");
-}
-
-void printkrxusb(struct rexgen_usb *dev)
-{
-    printkBuffer(dev->usb_rx_data, dev->usb_rx_len, "RX data");
-}
-
-void printktx(struct rexgen_cmd * cmd)
-{
-    printkBuffer(cmd->tx_data, cmd->tx_len, "TX data");
-}
-
-void printkLiveData(void *buff, int len)
-{
-    if (USB_CMD_DEBUG != 1)
-        return;
+static unsigned int rx_buffer_size = USB_RX_BUFFER_SIZE;
+module_param(rx_buffer_size, uint, 0444);
+MODULE_PARM_DESC(rx_buffer_size, "Size of a live data RX URB in bytes (max 16384, default 512)");
 
-    unsigned short blockSize = 0;
-    unsigned short pos = 2;
+static unsigned int tx_batch = USB_DEF_TX_BATCH;
+module_param(tx_batch, uint, 0644);
+MODULE_PARM_DESC(tx_batch, "Max frames sent in one live data TX URB (1 disables batching, default 32)");
 
-    if (len < 2)
-        return;
-    
-    blockSize =  ((unsigned short*)buff)[0];
-    printk("%s: LiveData block size is %i, received %i bytes total", DeviceName, blockSize, len);
+bool rexgen_latency_hist = true;
+module_param_named(latency_hist, rexgen_latency_hist, bool, 0644);
+MODULE_PARM_DESC(latency_hist, "Sample per-frame latencies for the debugfs histograms (default on)");
 
-    while (pos < blockSize)
-    {
-        unsigned short uid = *(unsigned short*)(buff + pos);
-        unsigned char rSize = *(unsigned char*)(buff + pos + 2);
-        unsigned char dlc = *(unsigned char*)(buff + pos + 3);
-        unsigned int timestamp = *(unsigned int*)(buff + pos + 4);
+static bool spread_cpus;
+module_param(spread_cpus, bool, 0644);
+MODULE_PARM_DESC(spread_cpus, "Bind the RX processing of each new device to its own CPU, round robin (default off)");
 
-        printk("%s: UID - %i, InfSize - %i, DLC - %i, Timestamp - %i\n", DeviceName, uid, rSize, dlc, timestamp);
+static atomic_t next_rx_cpu = ATOMIC_INIT(0);
 
-        if (uid == 100 || uid == 200)
-        {
-            printkBuffer(buff + 4 + rSize, dlc, "data");
-        }
-        pos += rSize + dlc + 4;   //skip bytes from unknown frames
-    }
-}
 
 // Forward declarations
 static void unlink_tx_urbs(struct rexgen_net *net);
@@ -167,67 +119,254 @@ struct sk_buff *alloc_canfd_skb(struct net_device *dev, struct canfd_frame **cfd
    return skb;
 }
 
+static void read_bulk_callback(struct urb *urb);
+
+static void resubmit_rx_urb(struct rexgen_usb *dev, struct urb *urb)
+{
+    int err;
+    unsigned int i;
+
+    usb_fill_bulk_urb(urb, dev->udev,
+            usb_rcvbulkpipe(dev->udev, dev->live_in->bEndpointAddress),
+            urb->transfer_buffer, dev->rx_buffer_size,
+            read_bulk_callback, dev);
+    usb_anchor_urb(urb, &dev->rx_submitted);
+
+    err = usb_submit_urb(urb, GFP_ATOMIC);
+    if (!err)
+        return;
+
+    usb_unanchor_urb(urb);
+    this_cpu_inc(dev->xstats->rx_resubmit_errors);
+    if (err == -ENODEV) {
+        for (i = 0; i < dev->nchannels; i++) {
+            if (!dev->nets[i])
+                continue;
+
+            netif_device_detach(dev->nets[i]->netdev);
+        }
+    } else {
+        dev_err(&dev->intf->dev,
+            "Failed resubmitting read bulk urb: %d\n", err);
+    }
+}
+
+static void rx_halt_work(struct work_struct *work)
+{
+    struct rexgen_usb *dev = container_of(work, struct rexgen_usb, rx_halt_work);
+    struct urb *urb;
+    int err;
+
+    err = usb_clear_halt(dev->udev,
+            usb_rcvbulkpipe(dev->udev, dev->live_in->bEndpointAddress));
+    if (err && err != -ENODEV)
+        dev_err(&dev->intf->dev, "Cannot clear live RX halt: %d\n", err);
+
+    while ((urb = usb_get_from_anchor(&dev->rx_halted)))
+    {
+        if (!READ_ONCE(dev->rx_stopping))
+            resubmit_rx_urb(dev, urb);
+        usb_put_urb(urb);
+    }
+}
+
+static void rx_ipi_func(void *info)
+{
+    struct rexgen_usb *dev = info;
+
+    napi_schedule(&dev->napi);
+    clear_bit(0, &dev->rx_ipi);
+}
+
+// Schedules the NAPI poll on dev->rx_cpu. While an IPI is in flight a new
+// completion needs nothing more, the poll it schedules picks up the URB.
+static void schedule_rx(struct rexgen_usb *dev)
+{
+    int cpu = READ_ONCE(dev->rx_cpu);
+
+    if (cpu < 0 || cpu == smp_processor_id() || !cpu_online(cpu))
+    {
+        napi_schedule(&dev->napi);
+        return;
+    }
+
+    if (test_and_set_bit(0, &dev->rx_ipi))
+        return;
+
+    if (smp_call_function_single_async(cpu, &dev->rx_csd))
+    {
+        napi_schedule(&dev->napi);
+        clear_bit(0, &dev->rx_ipi);
+    }
+}
+
 static void read_bulk_callback(struct urb *urb)
 {
     struct rexgen_usb *dev = urb->context;
-    int err;
-    unsigned int i, live_size;
-    unsigned short pos;
-    usb_record rec;
-    void* usb_buff;
+    unsigned long flags;
 
+    trace_rexgen_rx_urb(dev, urb);
+
+    // same policy as the command URB, only unlink and disconnect end it
     switch (urb->status) {
     case 0:
         break;
     case -ENOENT:
-    case -EPIPE:
-    case -EPROTO:
+    case -ECONNRESET:
     case -ESHUTDOWN:
         return;
+    case -EPIPE:
+        // clearing the halt sleeps, the work item resubmits the parked URBs
+        this_cpu_inc(dev->xstats->rx_urb_errors);
+        usb_anchor_urb(urb, &dev->rx_halted);
+        if (!READ_ONCE(dev->rx_stopping))
+        {
+            dev_warn_ratelimited(&dev->intf->dev, "Live RX endpoint stalled\n");
+            schedule_work(&dev->rx_halt_work);
+        }
+        return;
     default:
-        dev_info(&dev->intf->dev, "Rx URB aborted (%d)\n", urb->status);
-        goto resubmit_urb;
+        // -EPROTO, -EILSEQ, ...: a transient bus error, only this block is lost
+        this_cpu_inc(dev->xstats->rx_urb_errors);
+        dev_info_ratelimited(&dev->intf->dev, "Rx URB aborted (%d)\n", urb->status);
+        resubmit_rx_urb(dev, urb);
+        return;
     }
 
-    usb_buff = urb->transfer_buffer;
-    while (usb_buff < urb->transfer_buffer + urb->actual_length)
+    this_cpu_inc(dev->xstats->rx_urbs);
+    this_cpu_add(dev->xstats->rx_urb_bytes, urb->actual_length);
+
+    if (!urb->actual_length)
     {
-        live_size = livedata_size(usb_buff, urb->transfer_buffer + urb->actual_length - usb_buff);
-        if (live_size > urb->transfer_buffer + urb->actual_length - usb_buff)
-            break;
+        resubmit_rx_urb(dev, urb);
+        return;
+    }
+
+    // Only queue the block here, records are parsed and delivered from the NAPI poll.
+    // The URB is resubmitted once the poll has consumed it.
+    usb_get_urb(urb);
+    spin_lock_irqsave(&dev->rx_done_lock, flags);
+    if (rexgen_latency_hist)
+    {
+        dev->rx_done_ns[dev->rx_done_head % USB_MAX_RX_URBS] = ktime_get_ns();
+        dev->rx_done_real_ns[dev->rx_done_head % USB_MAX_RX_URBS] = ktime_get_real_ns();
+    }
+    dev->rx_done[dev->rx_done_head++ % USB_MAX_RX_URBS] = urb;
+    spin_unlock_irqrestore(&dev->rx_done_lock, flags);
 
-        //printk("ReXgen: LiveData block size is %i, actual length is %i", live_size, urb->actual_length);
-        memcpy(&dev->usb_rx_data, usb_buff, live_size);
-        dev->usb_rx_len = live_size;
+    schedule_rx(dev);
+}
+
+static int parse_rx_urb(struct rexgen_usb *dev, struct urb *urb, int budget)
+{
+    const struct rexgen_uid_entry *entry;
+    usb_record rec;
+    int work_done = 0;
 
-        pos = 2;
-        while (pos < live_size)
+    while (work_done < budget)
+    {
+        switch (rexgen_walk_next(urb->transfer_buffer, urb->actual_length,
+                                 &dev->rx_block, &dev->rx_pos, &rec))
         {
-            pos+= ptr2rec(&rec, usb_buff + pos);
-            if (rec.uid >= 100 && rec.uid < 100 + dev->nchannels)
-                can2socket(dev, &rec);
+        case REXGEN_WALK_END:
+            return work_done;
+
+        case REXGEN_WALK_BLOCK:
+            this_cpu_inc(dev->xstats->rx_blocks);
+            break;
+
+        case REXGEN_WALK_BAD_BLOCK:
+            this_cpu_inc(dev->xstats->rx_block_aborts);
+            break;
+
+        case REXGEN_WALK_TRUNCATED:
+            this_cpu_inc(dev->xstats->rx_records_truncated);
+            break;
+
+        case REXGEN_WALK_RECORD:
+            this_cpu_inc(dev->xstats->rx_records);
+            trace_rexgen_rx_record(dev, &rec);
+            entry = rexgen_uid_lookup(dev, rec.uid);
+            if (!entry)
+            {
+                this_cpu_inc(dev->xstats->rx_records_unknown);
+            }
+            else
+            {
+                if (entry->kind == IDX_CAN_BLOCK_UID_ERR)
+                    this_cpu_inc(dev->xstats->rx_records_err);
+                else
+                    this_cpu_inc(dev->xstats->rx_records_can);
+                entry->handler(dev, entry->net, &rec);
+            }
+            work_done++;
+            break;
         }
-        usb_buff += 512;
     }
 
-resubmit_urb:
-    usb_fill_bulk_urb(urb, dev->udev,
-            usb_rcvbulkpipe(dev->udev, dev->live_in->bEndpointAddress),
-            urb->transfer_buffer, USB_RX_BUFFER_SIZE,
-            read_bulk_callback, dev);
+    return work_done;
+}
 
-    err = usb_submit_urb(urb, GFP_ATOMIC);
-    if (err == -ENODEV) {
-        for (i = 0; i < dev->nchannels; i++) {
-            if (!dev->nets[i])
-                continue;
+static int rx_poll(struct napi_struct *napi, int budget)
+{
+    struct rexgen_usb *dev = container_of(napi, struct rexgen_usb, napi);
+    struct urb *urb;
+    unsigned long flags;
+    int work_done = 0, i;
 
-            netif_device_detach(dev->nets[i]->netdev);
+    while (work_done < budget)
+    {
+        spin_lock_irqsave(&dev->rx_done_lock, flags);
+        urb = NULL;
+        if (dev->rx_done_tail != dev->rx_done_head)
+        {
+            urb = dev->rx_done[dev->rx_done_tail % USB_MAX_RX_URBS];
+            dev->rx_urb_ns = dev->rx_done_ns[dev->rx_done_tail % USB_MAX_RX_URBS];
+            dev->rx_urb_real_ns = dev->rx_done_real_ns[dev->rx_done_tail % USB_MAX_RX_URBS];
         }
-    } else if (err) {
-        dev_err(&dev->intf->dev,
-            "Failed resubmitting read bulk urb: %d\n", err);
+        spin_unlock_irqrestore(&dev->rx_done_lock, flags);
+
+        if (!urb)
+            break;
+
+        work_done += parse_rx_urb(dev, urb, budget - work_done);
+        if (dev->rx_block < urb->actual_length)
+            break; // budget exhausted, continue from the same record on the next poll
+
+        spin_lock_irqsave(&dev->rx_done_lock, flags);
+        dev->rx_done_tail++;
+        spin_unlock_irqrestore(&dev->rx_done_lock, flags);
+
+        dev->rx_block = 0;
+        dev->rx_pos = 0;
+        resubmit_rx_urb(dev, urb);
+        usb_put_urb(urb);
     }
+
+    // failed transfers of loopback mode, on_close() frees the slots itself
+    for (i = 0; i < dev->nchannels; i++)
+        if (dev->nets[i] && READ_ONCE(dev->nets[i]->echo_failed) &&
+            READ_ONCE(dev->nets[i]->echo_confirmed))
+        {
+            WRITE_ONCE(dev->nets[i]->echo_failed, false);
+            reap_tx_echo(dev->nets[i]);
+        }
+
+    if (work_done < budget)
+        napi_complete_done(napi, work_done);
+
+    return work_done;
+}
+
+static void setup_rx_size(struct rexgen_usb *dev)
+{
+    unsigned int maxp = usb_endpoint_maxp(dev->live_in);
+
+    dev->rx_urb_count = clamp_t(unsigned int, rx_urbs, 1, USB_MAX_RX_URBS);
+
+    // whole packets only, a transfer may carry several live data blocks
+    dev->rx_buffer_size = clamp_t(unsigned int, rx_buffer_size, maxp, USB_TRANSFER_BLOCK_SIZE);
+    dev->rx_buffer_size -= dev->rx_buffer_size % maxp;
 }
 
 static int setup_rx_urbs(struct rexgen_usb *dev)
@@ -237,7 +376,7 @@ static int setup_rx_urbs(struct rexgen_usb *dev)
     if (dev->rxinitdone)
 	return 0;
 
-    for (i = 0; i < USB_MAX_RX_URBS; i++) {
+    for (i = 0; i < dev->rx_urb_count; i++) {
 	   struct urb *urb = NULL;
 	   u8 *buf = NULL;
 	   dma_addr_t buf_dma;
@@ -248,7 +387,7 @@ static int setup_rx_urbs(struct rexgen_usb *dev)
 	       break;
 	   }
 
-	   buf = usb_alloc_coherent(dev->udev, USB_RX_BUFFER_SIZE, GFP_KERNEL, &buf_dma);
+	   buf = usb_alloc_coherent(dev->udev, dev->rx_buffer_size, GFP_KERNEL, &buf_dma);
 	   if (!buf) {
 	       printk("No memory left for USB buffer");
 	       usb_free_urb(urb);
@@ -259,7 +398,7 @@ static int setup_rx_urbs(struct rexgen_usb *dev)
        printk("%s: Setup live rx urb", DeviceName);
 	   usb_fill_bulk_urb(urb, dev->udev, usb_rcvbulkpipe
 		    (dev->udev, dev->live_in->bEndpointAddress),
-		      buf, USB_RX_BUFFER_SIZE, read_bulk_callback, dev);
+		      buf, dev->rx_buffer_size, read_bulk_callback, dev);
 	   urb->transfer_dma = buf_dma;
 	   urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 	   usb_anchor_urb(urb, &dev->rx_submitted);
@@ -267,7 +406,7 @@ static int setup_rx_urbs(struct rexgen_usb *dev)
 	   err = usb_submit_urb(urb, GFP_KERNEL);
 	   if (err) {
 	       usb_unanchor_urb(urb);
-	       usb_free_coherent(dev->udev, USB_RX_BUFFER_SIZE, buf, buf_dma);
+	       usb_free_coherent(dev->udev, dev->rx_buffer_size, buf, buf_dma);
 	       usb_free_urb(urb);
 	       break;
 	   }
@@ -281,7 +420,7 @@ static int setup_rx_urbs(struct rexgen_usb *dev)
 	   printk("Cannot setup read URBs, error %d\n", err);
 	   return err;
     } 
-    else if (i < USB_MAX_RX_URBS) {
+    else if (i < dev->rx_urb_count) {
 	   printk("RX performances may be slow");
     }
 
@@ -290,19 +429,227 @@ static int setup_rx_urbs(struct rexgen_usb *dev)
     return 0;
 }
 
-static void write_bulk_callback(struct urb *urb)
+static struct usb_tx_context *get_tx_context(struct rexgen_net *net)
 {
-    struct usb_tx_context *context = urb->context;
-    struct rexgen_net *net;
-    struct net_device *netdev;
+    unsigned int head = net->tx_head;
+
+    if (head - smp_load_acquire(&net->tx_tail) >= USB_MAX_TX_URBS)
+        return NULL;
+
+    WRITE_ONCE(net->tx_head, head + 1);
+    return &net->tx_contexts[head % USB_MAX_TX_URBS];
+}
+
+// Queue 0 may fill the shared rings, the lower priority queues only send while
+// a few frames are in flight. A frame of queue 0 thus waits behind at most
+// USB_TX_LOW_ECHO frames of the other queues in USB_TX_LOW_URBS transfers, and
+// not behind the whole ring of bulk traffic already handed to the device.
+static unsigned int tx_urb_limit(unsigned int queue)
+{
+    return queue ? USB_TX_LOW_URBS : USB_MAX_TX_URBS;
+}
+
+static unsigned int tx_echo_limit(unsigned int queue)
+{
+    return queue ? USB_TX_LOW_ECHO >> (queue - 1) : USB_MAX_TX_ECHO;
+}
+
+static bool tx_ring_full(struct rexgen_net *net, unsigned int queue)
+{
+    return READ_ONCE(net->tx_head) - READ_ONCE(net->tx_tail) >= tx_urb_limit(queue) ||
+        READ_ONCE(net->echo_head) - READ_ONCE(net->echo_tail) >= tx_echo_limit(queue);
+}
+
+static bool tx_ring_may_wake(struct rexgen_net *net, unsigned int queue)
+{
+    return READ_ONCE(net->tx_head) - READ_ONCE(net->tx_tail) <= tx_urb_limit(queue) * 3 / 4 &&
+        READ_ONCE(net->echo_head) - READ_ONCE(net->echo_tail) <= tx_echo_limit(queue) * 3 / 4;
+}
+
+// Highest priority first: woken queues are run by the stack in this order
+static void wake_tx_queue(struct rexgen_net *net)
+{
+    struct netdev_queue *txq;
+    unsigned int i;
+
+    // pairs with the barrier in stop_tx_queues()
+    smp_mb();
+    for (i = 0; i < net->netdev->real_num_tx_queues; i++)
+    {
+        txq = netdev_get_tx_queue(net->netdev, i);
+        if (netif_tx_queue_stopped(txq) && tx_ring_may_wake(net, i))
+            netif_tx_wake_queue(txq);
+    }
+}
+
+// A frame of any queue may push the lower priority queues over their limits
+static void stop_tx_queues(struct rexgen_net *net)
+{
+    struct netdev_queue *txq;
+    unsigned int i;
+
+    for (i = net->netdev->real_num_tx_queues; i-- > 0; )
+    {
+        txq = netdev_get_tx_queue(net->netdev, i);
+        if (!tx_ring_full(net, i))
+            break; // the queues above have higher limits
+        if (netif_tx_queue_stopped(txq))
+            continue;
+
+        netif_tx_stop_queue(txq);
+        this_cpu_inc(net->stats->tx_queue_stops);
+
+        // a completion may have freed contexts before the queue was stopped
+        smp_mb();
+        if (tx_ring_may_wake(net, i))
+            netif_tx_wake_queue(txq);
+    }
+}
+
+static void put_tx_context(struct usb_tx_context *context)
+{
+    struct rexgen_net *net = context->net;
+
+    netdev_tx_completed_queue(netdev_get_tx_queue(net->netdev, context->queue),
+            context->frames, context->len);
+    smp_store_release(&net->tx_tail, net->tx_tail + 1);
+    wake_tx_queue(net);
+}
+
+static void echo_tx_frame(struct rexgen_net *net, unsigned int idx)
+{
+    rexgen_tx_stats(net, 1, net->tx_echo[idx].len, 0, 0);
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0))
+    can_get_echo_skb(net->netdev, idx, NULL);
+#else
+    can_get_echo_skb(net->netdev, idx);
+#endif
+}
+
+static void free_tx_echo(struct rexgen_net *net, unsigned int idx)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0))
+    can_free_echo_skb(net->netdev, idx, NULL);
+#else
+    can_free_echo_skb(net->netdev, idx);
+#endif
+}
+
+// Releases the echo slots of a finished transfer when the device does not confirm frames
+static void echo_tx_context(struct usb_tx_context *context, bool sent)
+{
+    struct rexgen_net *net = context->net;
+    unsigned int i, idx;
 
-    if ((!context))
+    for (i = 0; i < context->frames; i++)
+    {
+        idx = (context->echo_index + i) % USB_MAX_TX_ECHO;
+        if (sent)
+            echo_tx_frame(net, idx);
+        else
+            free_tx_echo(net, idx);
+    }
+
+    if (!sent)
+        rexgen_tx_stats(net, 0, 0, 0, context->frames);
+
+    smp_store_release(&net->echo_tail, net->echo_tail + context->frames);
+}
+
+// Called from the NAPI poll for every DIR record of the channel
+void tx_confirm(struct rexgen_net *net, canid_t canid, u64 ns)
+{
+    struct sk_buff *skb;
+    unsigned int pos, head, tail;
+
+    if (!READ_ONCE(net->echo_confirmed))
+        return;
+
+    canid &= CAN_EFF_FLAG | CAN_EFF_MASK;
+    tail = net->echo_tail;
+    head = smp_load_acquire(&net->echo_head);
+
+    // confirmations arrive in send order, search forward in case one was lost
+    for (pos = tail; pos != head; pos++)
+        if (net->tx_echo[pos % USB_MAX_TX_ECHO].can_id == canid)
+            break;
+
+    // not sent through this interface
+    if (pos == head)
+        return;
+
+    trace_rexgen_echo(net->netdev, canid, pos, pos - tail);
+
+    for (; tail != pos; tail++)
+    {
+        free_tx_echo(net, tail % USB_MAX_TX_ECHO);
+        if (!net->tx_echo[tail % USB_MAX_TX_ECHO].failed)
+            rexgen_tx_stats(net, 0, 0, 0, 1);
+    }
+
+    if (net->tx_echo[pos % USB_MAX_TX_ECHO].xmit_ns && rexgen_latency_hist)
+        rexgen_hist_add(net, REXGEN_HIST_TX_CONFIRM,
+                ktime_get_ns() - net->tx_echo[pos % USB_MAX_TX_ECHO].xmit_ns);
+
+    skb = net->can.echo_skb[pos % USB_MAX_TX_ECHO];
+    if (skb)
+        skb_hwtstamps(skb)->hwtstamp = ns_to_ktime(ns);
+    echo_tx_frame(net, pos % USB_MAX_TX_ECHO);
+
+    smp_store_release(&net->echo_tail, pos + 1);
+    reap_tx_echo(net);
+    wake_tx_queue(net);
+}
+
+// Gives up the echo slots of a transfer that did not reach the device in
+// loopback mode, no DIR record will come for them. tx_confirm() may be walking
+// the slots, so they are only marked here and released from the NAPI poll.
+void echo_tx_failed(struct rexgen_net *net, unsigned int echo_index, unsigned int frames)
+{
+    unsigned int i;
+
+    for (i = 0; i < frames; i++)
+        WRITE_ONCE(net->tx_echo[(echo_index + i) % USB_MAX_TX_ECHO].failed, true);
+
+    WRITE_ONCE(net->echo_failed, true);
+    napi_schedule(&net->dev->napi);
+}
+
+// Called from the NAPI poll, releases the failed slots at echo_tail; those
+// behind a frame still waiting for its confirmation follow once it arrives
+void reap_tx_echo(struct rexgen_net *net)
+{
+    unsigned int tail = net->echo_tail, head = smp_load_acquire(&net->echo_head);
+
+    for (; tail != head && READ_ONCE(net->tx_echo[tail % USB_MAX_TX_ECHO].failed); tail++)
+        free_tx_echo(net, tail % USB_MAX_TX_ECHO);
+
+    if (tail == net->echo_tail)
         return;
 
-    net = context->net;
-    netdev = net->netdev;
+    smp_store_release(&net->echo_tail, tail);
+    wake_tx_queue(net);
+}
+
+static void write_bulk_callback(struct urb *urb)
+{
+    struct usb_tx_context *context = urb->context;
+    struct rexgen_net *net = context->net;
+    struct net_device *netdev = net->netdev;
+
+    trace_rexgen_tx_complete(netdev, context, urb->status);
+    if (urb->status)
+        this_cpu_inc(net->stats->tx_urb_errors);
 
-    kfree(urb->transfer_buffer);
+    if (!context->echoed)
+        echo_tx_context(context, !urb->status);
+    else if (urb->status)
+    {
+        rexgen_tx_stats(net, 0, 0, 0, context->frames);
+        echo_tx_failed(net, context->echo_index, context->frames);
+    }
+    put_tx_context(context);
 
     if (!netif_device_present(netdev))
     {
@@ -313,308 +660,975 @@ static void write_bulk_callback(struct urb *urb)
         netdev_info(netdev, "Tx URB aborted (%d)\n", urb->status);
 }
 
-static netdev_tx_t on_xmit(struct sk_buff *skb, struct net_device *netdev)
+// Submits the frames collected in the pending transfer as one bulk URB, called
+// with tx_lock held
+static void flush_tx(struct rexgen_net *net)
 {
-    struct rexgen_net *net = netdev_priv(netdev);
-    struct rexgen_usb *dev = net->dev;
-    struct net_device_stats *stats = &netdev->stats;
-    struct usb_tx_context *context = NULL;
+    struct usb_tx_context *context = net->tx_context;
+    struct net_device *netdev = net->netdev;
     struct urb *urb;
-    void *buf;
-    int cmd_len = 0;
-    int err, ret = NETDEV_TX_OK;
     unsigned int i;
-    unsigned long flags;
-    struct can_frame *cf = (struct can_frame *)skb->data;
-    struct canfd_frame *cfdf = (struct canfd_frame *)skb->data;
-    unsigned char *canlen;
-    canid_t *canid;
-    unsigned char canflags;
-    unsigned char *candata;
+    int err;
+
+    if (!context)
+        return;
+
+    net->tx_context = NULL;
+
+    context->len = net->tx_len;
+    urb = context->urb;
+    urb->transfer_buffer_length = context->len;
+    usb_anchor_urb(urb, &net->tx_submitted);
+
+    err = usb_submit_urb(urb, GFP_ATOMIC);
+    trace_rexgen_tx_submit(netdev, context, err);
+    if (unlikely(err))
+    {
+        usb_unanchor_urb(urb);
+        this_cpu_inc(net->stats->tx_submit_errors);
+        rexgen_tx_stats(net, 0, 0, context->frames, 0);
+
+        // the failed context and its frames are the newest ones, hand them
+        // straight back; published echo slots may already be seen by tx_confirm()
+        if (context->echoed)
+            echo_tx_failed(net, context->echo_index, context->frames);
+        else
+        {
+            for (i = 0; i < context->frames; i++)
+                free_tx_echo(net, (context->echo_index + i) % USB_MAX_TX_ECHO);
+            WRITE_ONCE(net->echo_head, context->echo_index);
+        }
+        WRITE_ONCE(net->tx_head, net->tx_head - 1);
+        netdev_tx_completed_queue(netdev_get_tx_queue(netdev, context->queue),
+                context->frames, context->len);
+
+        if (err == -ENODEV)
+        {
+            netif_device_detach(netdev);
+        }
+        else
+        {
+            netdev_warn(netdev, "Failed tx_urb %d\n", err);
+            wake_tx_queue(net);
+        }
+        return;
+    }
+
+    this_cpu_inc(net->stats->tx_urbs);
+    this_cpu_add(net->stats->tx_urb_bytes, context->len);
+    this_cpu_add(net->stats->tx_frames, context->frames);
+}
+
+// Takes an echo slot without skb for a frame of the cyclic table in loopback
+// mode, its DIR record is then matched in send order like any other. Called with
+// tx_lock held, the cyclic transfer must be submitted before the lock is dropped.
+bool echo_cyclic_frame(struct rexgen_net *net, canid_t canid, unsigned char len)
+{
+    struct usb_tx_echo *echo;
+
+    if (net->echo_head - smp_load_acquire(&net->echo_tail) >= USB_MAX_TX_ECHO)
+        return false;
+
+    // the echo slots of a transfer are consecutive, the pending one goes out first
+    flush_tx(net);
+
+    echo = &net->tx_echo[net->echo_head % USB_MAX_TX_ECHO];
+    echo->can_id = canid;
+    echo->len = len;
+    echo->failed = false;
+    echo->xmit_ns = rexgen_latency_hist ? ktime_get_ns() : 0;
+    smp_store_release(&net->echo_head, net->echo_head + 1);
+    stop_tx_queues(net);
+
+    return true;
+}
+
+static netdev_tx_t on_xmit(struct sk_buff *skb, struct net_device *netdev)
+{
+    struct rexgen_net *net = netdev_priv(netdev);
+    u16 queue = skb_get_queue_mapping(skb);
+    struct netdev_queue *txq = netdev_get_tx_queue(netdev, queue);
+    struct can_frame *cf = (struct can_frame *)skb->data;
+    struct canfd_frame *cfdf = (struct canfd_frame *)skb->data;
+    struct usb_tx_echo *echo;
+    unsigned char canlen;
+    canid_t canid;
+    unsigned char canflags;
+    unsigned char *candata;
+    unsigned int rec_len, echo_index;
+    bool more;
+
+    if (can_dropped_invalid_skb(netdev, skb))
+        return NETDEV_TX_OK;
+
+    spin_lock(&net->tx_lock);
+
+    // This should never happen; the queue is stopped before the echo slots run out
+    if (net->echo_head - smp_load_acquire(&net->echo_tail) >= USB_MAX_TX_ECHO)
+    {
+        netdev_warn(netdev, "cannot find free echo slot\n");
+        netif_tx_stop_queue(txq);
+        flush_tx(net);
+        spin_unlock(&net->tx_lock);
+        this_cpu_inc(net->stats->tx_busy);
+        return NETDEV_TX_BUSY;
+    }
+
+    // a transfer only carries frames of one queue, for the per-queue BQL
+    // accounting; the pending one of another queue goes out first
+    if (net->tx_context && net->tx_context->queue != queue)
+        flush_tx(net);
+
+    if (!net->tx_context)
+    {
+        net->tx_context = get_tx_context(net);
+
+        // This should never happen; it implies a flow control bug
+        if (!net->tx_context) {
+            netdev_warn(netdev, "cannot find free context\n");
+            netif_tx_stop_queue(txq);
+            spin_unlock(&net->tx_lock);
+            this_cpu_inc(net->stats->tx_busy);
+            return NETDEV_TX_BUSY;
+        }
+        net->tx_len = 0;
+        net->tx_context->frames = 0;
+        net->tx_context->echo_index = net->echo_head;
+        net->tx_context->queue = queue;
+        net->tx_context->echoed = net->echo_confirmed;
+    }
+
+    canflags = 0;
+    if (skb->protocol == htons(ETH_P_CANFD)) {
+        canid = cfdf->can_id;
+        canflags |= DataFrame_EDL;
+        canlen = cfdf->len;
+        candata = &cfdf->data[0];
+        if (0x01 & cfdf->flags)
+            canflags |= DataFrame_BRS;
+    } else {
+        #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0))
+            canlen = cf->len;
+        #else
+            canlen = cf->can_dlc;
+        #endif
+        canid = cf->can_id;
+        candata = &cf->data[0];
+    }
+    if (0x80000000U & canid)
+        canflags |= DataFrame_IDE;
+    canid &= 0x1FFFFFFFU;
+
+    rec_len = frame2rec(net->tx_context->buf + net->tx_len, net->usb_block_uid[IDX_CAN_BLOCK_UID_TX],
+        canid, canflags, candata, canlen);
+    net->tx_len += rec_len;
+    net->tx_context->frames++;
+    netdev_tx_sent_queue(txq, rec_len);
+
+    echo_index = net->echo_head % USB_MAX_TX_ECHO;
+    echo = &net->tx_echo[echo_index];
+    echo->can_id = canid | ((canflags & DataFrame_IDE) ? CAN_EFF_FLAG : 0);
+    echo->len = canlen;
+    echo->failed = false;
+    echo->xmit_ns = rexgen_latency_hist ? ktime_get_ns() : 0;
+    trace_rexgen_xmit(netdev, echo->can_id, canlen, net->echo_head);
+
+    if (net->hwts_tx && net->echo_confirmed && (skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP))
+        skb_shinfo(skb)->tx_flags |= SKBTX_IN_PROGRESS;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+    more = netdev_xmit_more();
+#else
+    more = skb->xmit_more;
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0))
+    can_put_echo_skb(skb, netdev, echo_index, 0);
+#else
+    can_put_echo_skb(skb, netdev, echo_index);
+#endif
+    smp_store_release(&net->echo_head, net->echo_head + 1);
+    stop_tx_queues(net);
+
+    // keep collecting while the stack has more frames queued for us, a queue
+    // stopped by us or by BQL must be flushed now
+    if (!more || net->tx_context->frames >= tx_batch ||
+        net->tx_len + RexRecordMaxLength > USB_TX_BUFFER_SIZE ||
+        netif_xmit_stopped(txq))
+        flush_tx(net);
+
+    spin_unlock(&net->tx_lock);
+    return NETDEV_TX_OK;
+}
+
+static void free_tx_urbs(struct rexgen_net *net)
+{
+    struct usb_tx_context *context;
+    int i;
+
+    for (i = 0; i < USB_TX_CONTEXTS; i++) {
+        context = &net->tx_contexts[i];
+        if (!context->urb)
+            continue;
+
+        usb_free_coherent(net->dev->udev, USB_TX_BUFFER_SIZE, context->buf, context->buf_dma);
+        usb_free_urb(context->urb);
+        context->urb = NULL;
+        context->buf = NULL;
+    }
+}
+
+static int setup_tx_urbs(struct rexgen_net *net)
+{
+    struct rexgen_usb *dev = net->dev;
+    struct usb_tx_context *context;
+    int i;
+
+    for (i = 0; i < USB_TX_CONTEXTS; i++) {
+        context = &net->tx_contexts[i];
+        context->net = net;
+
+        context->urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!context->urb)
+            goto nomem;
+
+        context->buf = usb_alloc_coherent(dev->udev, USB_TX_BUFFER_SIZE, GFP_KERNEL, &context->buf_dma);
+        if (!context->buf) {
+            usb_free_urb(context->urb);
+            context->urb = NULL;
+            goto nomem;
+        }
+
+        usb_fill_bulk_urb(context->urb, dev->udev,
+                  usb_sndbulkpipe(dev->udev, dev->live_out->bEndpointAddress),
+                  context->buf, USB_TX_BUFFER_SIZE,
+                  i < USB_MAX_TX_URBS ? write_bulk_callback : rexgen_cyclic_callback, context);
+        context->urb->transfer_dma = context->buf_dma;
+        // a batch may fill whole packets, the device needs a ZLP to see its end
+        context->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP | URB_ZERO_PACKET;
+    }
+
+    return 0;
+
+nomem:
+    free_tx_urbs(net);
+    return -ENOMEM;
+}
+
+static int on_open(struct net_device *netdev)
+{
+    struct rexgen_net *net = netdev_priv(netdev);
+    struct rexgen_usb *dev = net->dev;
+    int err;
+
+    err = open_candev(netdev);
+    if (err)
+    {
+        printk("%s: open_candev error %i", DeviceName, err);
+        goto error;
+    }
+
+    // firmware version, channel count and block UIDs are read once at probe
+    unsigned char flags = 0;
+    if (net->can.ctrlmode & CAN_CTRLMODE_LISTENONLY)
+        flags |= CAN_INTERFACE_LISTENONLY;
+    if (net->can.ctrlmode & CAN_CTRLMODE_LOOPBACK)
+        flags |= CAN_INTERFACE_LOOPBACK;
+    if (net->can.ctrlmode & CAN_CTRLMODE_FD)
+        flags |= CAN_INTERFACE_CAN_FD_ISO;
+    if (net->can.ctrlmode & CAN_CTRLMODE_FD_NON_ISO)
+        flags |= CAN_INTERFACE_CAN_FD_NON_ISO;
+
+    // the host side is set up first, a failure must not leave the channel on-bus
+    err = setup_rx_urbs(dev);
+    if (err)
+    {
+        printk("%s: Cannot setup rx urbs. Error %i", DeviceName, err);
+        goto error;
+    }
+
+    err = setup_tx_urbs(net);
+    if (err)
+    {
+        printk("%s: Cannot setup tx urbs. Error %i", DeviceName, err);
+        goto error;
+    }
+
+    err = usb_can_bus_start(net, flags);
+    if (err)
+    {
+        printk("%s: Cannot start channel %i, error %i", DeviceName, net->channel, err);
+        // part of the sequence may have gone through, take the channel down again
+        usb_can_bus_off(dev, net->channel);
+        usb_can_bus_close(dev, net->channel);
+        free_tx_urbs(net);
+        goto error;
+    }
+
+    // in loopback mode the device reports every transmitted frame as a DIR record
+    net->echo_confirmed = !!(net->can.ctrlmode & CAN_CTRLMODE_LOOPBACK);
+    memset(&net->bec, 0, sizeof(net->bec));
+    net->can.state = CAN_STATE_ERROR_ACTIVE;
+    rexgen_cyclic_start(net);
+
+    // the rings are empty again, queues stopped before the last close are released
+    netif_tx_start_all_queues(netdev);
+
+    return 0;
+
+error:
+    close_candev(netdev);
+    return err;
+}
+
+static int on_close(struct net_device *netdev)
+{
+    struct rexgen_net *net = netdev_priv(netdev);
+    struct rexgen_usb *dev = net->dev;
+    int err;
+    unsigned short channel = net->channel;
+
+    rexgen_cyclic_stop(net);
+
+    err = usb_can_bus_off(dev, channel);
+    if (err)
+    {
+        printk("%s: Cannot turn off channel %i, error %i", DeviceName, net->channel, err);
+    }
+
+    err = usb_can_bus_close(dev, channel);
+    if (err)
+    {
+        printk("%s: Cannot close channel %i, error %i", DeviceName, net->channel, err);
+    }
+
+    printk("%s: Closing net socket...", DeviceName);
+    //netif_stop_queue(netdev);
+
+    // no TX confirmation may be running while the echo slots are freed
+    WRITE_ONCE(net->echo_confirmed, false);
+    if (dev->napienabled)
+        napi_synchronize(&dev->napi);
+
+    unlink_tx_urbs(net);
+    free_tx_urbs(net);
+    net->can.state = CAN_STATE_STOPPED;
+    close_candev(net->netdev);
+    printk("%s: Socket closed!", DeviceName);
+    return 0;
+}
+
+
+static void reset_tx_urb_contexts(struct rexgen_net *net)
+{
+    net->tx_context = NULL;
+    net->tx_head = 0;
+    net->tx_tail = 0;
+    net->echo_head = 0;
+    net->echo_tail = 0;
+}
+
+static int on_ioctl(struct net_device *netdev, struct ifreq *ifr, int cmd)
+{
+    struct rexgen_net *net = netdev_priv(netdev);
+    struct hwtstamp_config cfg;
+
+    switch (cmd) {
+    case SIOCSHWTSTAMP:
+        if (copy_from_user(&cfg, ifr->ifr_data, sizeof(cfg)))
+            return -EFAULT;
+        if (cfg.tx_type != HWTSTAMP_TX_OFF && cfg.tx_type != HWTSTAMP_TX_ON)
+            return -ERANGE;
+        net->hwts_tx = cfg.tx_type == HWTSTAMP_TX_ON;
+        // every record carries a device timestamp, so all frames are stamped
+        cfg.rx_filter = HWTSTAMP_FILTER_ALL;
+        break;
+    case SIOCGHWTSTAMP:
+        cfg.flags = 0;
+        cfg.tx_type = net->hwts_tx ? HWTSTAMP_TX_ON : HWTSTAMP_TX_OFF;
+        cfg.rx_filter = HWTSTAMP_FILTER_ALL;
+        break;
+    default:
+        return -EOPNOTSUPP;
+    }
+
+    return copy_to_user(ifr->ifr_data, &cfg, sizeof(cfg)) ? -EFAULT : 0;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0))
+static void get_stats64(struct net_device *netdev, struct rtnl_link_stats64 *stats)
+#else
+static struct rtnl_link_stats64 *get_stats64(struct net_device *netdev, struct rtnl_link_stats64 *stats)
+#endif
+{
+    struct rexgen_net *net = netdev_priv(netdev);
+    unsigned int start;
+    int cpu;
+
+    // drops and errors counted by the CAN core are kept in netdev->stats
+    netdev_stats_to_stats64(stats, &netdev->stats);
+
+    for_each_possible_cpu(cpu)
+    {
+        const struct rexgen_pcpu_stats *pcpu = per_cpu_ptr(net->stats, cpu);
+        u64 rx_packets, rx_bytes, rx_dropped, rx_errors, rx_over_errors;
+        u64 tx_packets, tx_bytes, tx_dropped, tx_errors;
+
+        do {
+            start = u64_stats_fetch_begin(&pcpu->rx_syncp);
+            rx_packets = pcpu->rx_packets;
+            rx_bytes = pcpu->rx_bytes;
+            rx_dropped = pcpu->rx_dropped;
+            rx_errors = pcpu->rx_errors;
+            rx_over_errors = pcpu->rx_over_errors;
+        } while (u64_stats_fetch_retry(&pcpu->rx_syncp, start));
+
+        do {
+            start = u64_stats_fetch_begin(&pcpu->tx_syncp);
+            tx_packets = pcpu->tx_packets;
+            tx_bytes = pcpu->tx_bytes;
+            tx_dropped = pcpu->tx_dropped;
+            tx_errors = pcpu->tx_errors;
+        } while (u64_stats_fetch_retry(&pcpu->tx_syncp, start));
+
+        stats->rx_packets += rx_packets;
+        stats->rx_bytes += rx_bytes;
+        stats->rx_dropped += rx_dropped;
+        stats->rx_errors += rx_errors;
+        stats->rx_over_errors += rx_over_errors;
+        stats->tx_packets += tx_packets;
+        stats->tx_bytes += tx_bytes;
+        stats->tx_dropped += tx_dropped;
+        stats->tx_errors += tx_errors;
+    }
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0))
+    return stats;
+#endif
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+// TX queue of frames not matched by the ID map, by skb->priority (TC_PRIO_*)
+static const u16 prio2queue[TC_PRIO_MAX + 1] = {
+    2, 3, 3, 2, 2, 2, 1, 0, 2, 2, 2, 2, 2, 2, 2, 2
+};
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+static u16 select_queue(struct net_device *netdev, struct sk_buff *skb,
+        struct net_device *sb_dev)
+#else
+static u16 select_queue(struct net_device *netdev, struct sk_buff *skb,
+        struct net_device *sb_dev, select_queue_fallback_t fallback)
+#endif
+{
+    struct rexgen_net *net = netdev_priv(netdev);
+    const struct rexgen_txq_map *map;
+    const struct rexgen_txq_range *range;
+    u16 queue = prio2queue[skb->priority & TC_PRIO_MAX];
+    canid_t canid;
+    unsigned int i;
+    bool eff;
+
+    // can_id is at the same offset in CAN and CAN FD frames
+    if (skb->len >= sizeof(canid))
+    {
+        canid = ((struct can_frame *)skb->data)->can_id;
+        eff = canid & CAN_EFF_FLAG;
+        canid &= eff ? CAN_EFF_MASK : CAN_SFF_MASK;
+
+        rcu_read_lock();
+        map = rcu_dereference(net->txq_map);
+        for (i = 0; map && i < map->count; i++)
+        {
+            range = &map->ranges[i];
+            if (range->eff == eff && canid >= range->from && canid <= range->to)
+            {
+                queue = range->queue;
+                break;
+            }
+        }
+        rcu_read_unlock();
+    }
+
+    return min_t(u16, queue, netdev->real_num_tx_queues - 1);
+}
+#endif
+
+static const struct net_device_ops rex_ops = {
+    .ndo_open = on_open,
+    .ndo_stop = on_close,
+    .ndo_start_xmit = on_xmit,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+    .ndo_select_queue = select_queue,
+#endif
+    .ndo_change_mtu = can_change_mtu,
+    .ndo_get_stats64 = get_stats64,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0))
+    .ndo_eth_ioctl = on_ioctl,
+#else
+    .ndo_do_ioctl = on_ioctl,
+#endif
+};
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0))
+static int get_ts_info(struct net_device *netdev, struct kernel_ethtool_ts_info *info)
+#else
+static int get_ts_info(struct net_device *netdev, struct ethtool_ts_info *info)
+#endif
+{
+    info->so_timestamping =
+        SOF_TIMESTAMPING_TX_SOFTWARE |
+        SOF_TIMESTAMPING_RX_SOFTWARE |
+        SOF_TIMESTAMPING_SOFTWARE |
+        SOF_TIMESTAMPING_TX_HARDWARE |
+        SOF_TIMESTAMPING_RX_HARDWARE |
+        SOF_TIMESTAMPING_RAW_HARDWARE;
+    info->phc_index = -1;
+    info->tx_types = BIT(HWTSTAMP_TX_OFF) | BIT(HWTSTAMP_TX_ON);
+    info->rx_filters = BIT(HWTSTAMP_FILTER_ALL);
+    return 0;
+}
+
+struct rexgen_stat_desc {
+    char name[ETH_GSTRING_LEN];
+    size_t offset;
+};
+
+#define REXGEN_DEV_STAT(m) { "dev_" #m, offsetof(struct rexgen_usb_xstats, m) }
+#define REXGEN_NET_STAT(m) { #m, offsetof(struct rexgen_pcpu_stats, m) }
+
+static const struct rexgen_stat_desc rexgen_dev_stats[] = {
+    REXGEN_DEV_STAT(rx_urbs),
+    REXGEN_DEV_STAT(rx_urb_bytes),
+    REXGEN_DEV_STAT(rx_urb_errors),
+    REXGEN_DEV_STAT(rx_resubmit_errors),
+    REXGEN_DEV_STAT(rx_blocks),
+    REXGEN_DEV_STAT(rx_block_aborts),
+    REXGEN_DEV_STAT(rx_records),
+    REXGEN_DEV_STAT(rx_records_truncated),
+    REXGEN_DEV_STAT(rx_records_can),
+    REXGEN_DEV_STAT(rx_records_err),
+    REXGEN_DEV_STAT(rx_records_unknown),
+    REXGEN_DEV_STAT(cmd_sent),
+    REXGEN_DEV_STAT(cmd_timeouts),
+    REXGEN_DEV_STAT(cmd_errors),
+};
+
+static const struct rexgen_stat_desc rexgen_net_stats[] = {
+    REXGEN_NET_STAT(rx_records),
+    REXGEN_NET_STAT(tx_urbs),
+    REXGEN_NET_STAT(tx_urb_bytes),
+    REXGEN_NET_STAT(tx_frames),
+    REXGEN_NET_STAT(tx_submit_errors),
+    REXGEN_NET_STAT(tx_urb_errors),
+    REXGEN_NET_STAT(tx_queue_stops),
+    REXGEN_NET_STAT(tx_busy),
+};
+
+// values computed when read, after the counters above
+static const char rexgen_derived_stats[][ETH_GSTRING_LEN] = {
+    "dev_rx_urb_avg_bytes",
+    "dev_rx_urb_avg_blocks",
+    "tx_urb_avg_frames",
+    "tx_urbs_in_flight",
+    "rx_filtered",
+};
+
+#define REXGEN_NUM_STATS (ARRAY_SIZE(rexgen_dev_stats) + ARRAY_SIZE(rexgen_net_stats) + \
+        ARRAY_SIZE(rexgen_derived_stats))
+
+static int get_sset_count(struct net_device *netdev, int sset)
+{
+    if (sset != ETH_SS_STATS)
+        return -EOPNOTSUPP;
+
+    return REXGEN_NUM_STATS;
+}
+
+static void get_strings(struct net_device *netdev, u32 sset, u8 *data)
+{
+    unsigned int i;
+
+    if (sset != ETH_SS_STATS)
+        return;
+
+    for (i = 0; i < ARRAY_SIZE(rexgen_dev_stats); i++, data += ETH_GSTRING_LEN)
+        memcpy(data, rexgen_dev_stats[i].name, ETH_GSTRING_LEN);
+    for (i = 0; i < ARRAY_SIZE(rexgen_net_stats); i++, data += ETH_GSTRING_LEN)
+        memcpy(data, rexgen_net_stats[i].name, ETH_GSTRING_LEN);
+    memcpy(data, rexgen_derived_stats, sizeof(rexgen_derived_stats));
+}
+
+static u64 sum_percpu_stat(const void __percpu *stats, size_t offset)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += *(const u64 *)((const char *)per_cpu_ptr(stats, cpu) + offset);
+
+    return sum;
+}
+
+static void get_ethtool_stats(struct net_device *netdev, struct ethtool_stats *estats, u64 *data)
+{
+    struct rexgen_net *net = netdev_priv(netdev);
+    struct rexgen_usb *dev = net->dev;
+    u64 rx_urbs, tx_urbs;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(rexgen_dev_stats); i++)
+        *data++ = sum_percpu_stat(dev->xstats, rexgen_dev_stats[i].offset);
+    for (i = 0; i < ARRAY_SIZE(rexgen_net_stats); i++)
+        *data++ = sum_percpu_stat(net->stats, rexgen_net_stats[i].offset);
+
+    rx_urbs = sum_percpu_stat(dev->xstats, offsetof(struct rexgen_usb_xstats, rx_urbs));
+    tx_urbs = sum_percpu_stat(net->stats, offsetof(struct rexgen_pcpu_stats, tx_urbs));
+    *data++ = rx_urbs ? div64_u64(sum_percpu_stat(dev->xstats,
+            offsetof(struct rexgen_usb_xstats, rx_urb_bytes)), rx_urbs) : 0;
+    *data++ = rx_urbs ? div64_u64(sum_percpu_stat(dev->xstats,
+            offsetof(struct rexgen_usb_xstats, rx_blocks)), rx_urbs) : 0;
+    *data++ = tx_urbs ? div64_u64(sum_percpu_stat(net->stats,
+            offsetof(struct rexgen_pcpu_stats, tx_frames)), tx_urbs) : 0;
+    *data++ = READ_ONCE(net->tx_head) - READ_ONCE(net->tx_tail);
+    *data++ = READ_ONCE(net->rx_filtered);
+}
+
+static const struct ethtool_ops rex_ethtool_ops = {
+    .get_ts_info = get_ts_info,
+    .get_sset_count = get_sset_count,
+    .get_strings = get_strings,
+    .get_ethtool_stats = get_ethtool_stats,
+};
+
+static int get_berr_counter(const struct net_device *netdev, struct can_berr_counter *bec)
+{
+    struct rexgen_net *net = netdev_priv(netdev);
+    *bec = net->bec;
+    return 0;
+}
+
+// restart after bus off, manually or by restart-ms
+static int set_mode(struct net_device *netdev, enum can_mode mode)
+{
+    struct rexgen_net *net = netdev_priv(netdev);
+    int err;
+
+    switch (mode)
+    {
+        case CAN_MODE_START:
+            err = usb_can_bus_on(net->dev, net->channel);
+            if (err)
+                return err;
+
+            memset(&net->bec, 0, sizeof(net->bec));
+            net->can.state = CAN_STATE_ERROR_ACTIVE;
+            netif_tx_wake_all_queues(netdev);
+            return 0;
+        default:
+            return -EOPNOTSUPP;
+    }
+}
 
+static int filter_cmp(const void *a, const void *b)
+{
+    const struct rexgen_filter_range *ra = a, *rb = b;
 
-    if (can_dropped_invalid_skb(netdev, skb))
-        return NETDEV_TX_OK;
+    if (ra->from < rb->from)
+        return -1;
+    return ra->from > rb->from;
+}
 
-    urb = usb_alloc_urb(0, GFP_ATOMIC);
-    if (!urb) {
-        stats->tx_dropped++;
-        dev_kfree_skb(skb);
-        return NETDEV_TX_OK;
-    }
+// a hex ID or ID range like "123", "200-27f" or "18fef100-18fef1ff", 8 digits are a 29 bit ID
+static int parse_id_range(char *tok, u32 *first_id, u32 *last_id, bool *eff)
+{
+    char *last;
 
-    /*spin_lock_irqsave(&net->tx_contexts_lock, flags);
-    for (i = 0; i < USB_MAX_TX_URBS; i++) {
-        if (net->tx_contexts[i].echo_index == USB_MAX_TX_URBS) {
-            context = &net->tx_contexts[i];
+    last = strchr(tok, '-');
+    if (last)
+        *last++ = 0;
+    else
+        last = tok;
 
-            context->echo_index = i;
-            ++net->active_tx_contexts;
-            if (net->active_tx_contexts >= (int)USB_MAX_TX_URBS)
-                netif_stop_queue(netdev);
+    *eff = strlen(tok) == 8;
+    if ((strlen(last) == 8) != *eff ||
+        kstrtou32(tok, 16, first_id) || kstrtou32(last, 16, last_id) ||
+        *first_id > *last_id || *last_id > (*eff ? CAN_EFF_MASK : CAN_SFF_MASK))
+        return -EINVAL;
 
-            break;
-        }
-    }
-    spin_unlock_irqrestore(&net->tx_contexts_lock, flags);*/
-    spin_lock_irqsave(&net->tx_contexts_lock, flags);
-    context = &net->tx_contexts[0];
-    context->echo_index = 0;
-    spin_unlock_irqrestore(&net->tx_contexts_lock, flags);
+    return 0;
+}
+
+// IDs or ID ranges separated by spaces or commas, see parse_id_range()
+static int parse_rx_filter(struct rexgen_filter *filter, char *str)
+{
+    char *tok;
+    u32 first_id, last_id;
+    unsigned int i, n;
+    bool eff;
 
-    // * This should never happen; it implies a flow control bug * /
-    /*if (!context) {
-        netdev_warn(netdev, "cannot find free context\n");
+    while ((tok = strsep(&str, " ,\n")) != NULL)
+    {
+        if (!*tok)
+            continue;
 
-        ret = NETDEV_TX_BUSY;
-        goto freeurb;
-    }*/
+        if (parse_id_range(tok, &first_id, &last_id, &eff))
+            return -EINVAL;
 
-    canflags = 0;
-    if (skb->protocol == htons(ETH_P_CAN)) {
-        #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0))
-            canlen = &cf->len;
-        #else
-            canlen = &cf->can_dlc;
-        #endif
-        canid = &cf->can_id;
-        candata = &cf->data[0];
-    } else if (skb->protocol == htons(ETH_P_CANFD)) {
-        canid = &cfdf->can_id;
-        canflags |= DataFrame_EDL;
-        canlen = &cfdf->len;
-        candata = &cfdf->data[0];
-        if (0x01 & cfdf->flags)
-            canflags |= DataFrame_BRS;
-    }
-    if (0x80000000U & *canid)
-        canflags |= DataFrame_IDE;
-    *canid &= 0x1FFFFFFFU;
-
-    cmd_len = 4 + 9 + *canlen;
-    buf = kmalloc(512, GFP_ATOMIC);
-    if (buf) {
-        // Header
-        *((unsigned short*)(buf + 0)) = 1200 + net->channel;
-        *((unsigned char*)(buf + 2)) = 9;
-        *((unsigned char*)(buf + 3)) = *canlen;
-        // Inf data
-        *((unsigned long*)(buf + 4)) = 0;
-        *((unsigned long*)(buf + 8)) = *canid;
-        *((unsigned char*)(buf + 12)) = canflags;
-        // Can data
-        memcpy(buf + 13, candata, *canlen);
-
-        if (net->can.ctrlmode & CAN_CTRLMODE_LOOPBACK)
-        //if (!net->echoskb)
+        if (!eff)
         {
-            spin_lock_irqsave(&net->tx_contexts_lock, flags);
-            net->echoskb = can_create_echo_skb(skb);
-            skb->pkt_type = PACKET_BROADCAST;
-            skb->ip_summed = CHECKSUM_UNNECESSARY;
-            skb->dev = netdev;
-            spin_unlock_irqrestore(&net->tx_contexts_lock, flags);
+            bitmap_set(filter->sff, first_id, last_id - first_id + 1);
+            continue;
         }
-    }
 
-    if (!buf) {
-        stats->tx_dropped++;
-        dev_kfree_skb(skb);
-        spin_lock_irqsave(&net->tx_contexts_lock, flags);
+        if (filter->neff == USB_MAX_FILTER_RANGES)
+            return -ENOSPC;
 
-        /*context->echo_index = USB_MAX_TX_URBS;*/
-        --net->active_tx_contexts;
-        netif_wake_queue(netdev);
-
-        spin_unlock_irqrestore(&net->tx_contexts_lock, flags);
-        goto freeurb;
+        filter->eff[filter->neff].from = first_id;
+        filter->eff[filter->neff].to = last_id;
+        filter->neff++;
     }
 
-    context->net = net;
-
-    /*spin_lock_irqsave(&net->tx_contexts_lock, flags);
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0))
-    can_put_echo_skb(skb, netdev, context->echo_index, 0);
-#else
-    can_put_echo_skb(skb, netdev, context->echo_index);
-#endif
-    spin_unlock_irqrestore(&net->tx_contexts_lock, flags);*/
-    //printkBuffer(buf, cmd_len, "Socket TX");
-
-    usb_fill_bulk_urb(urb, dev->udev,
-              usb_sndbulkpipe(dev->udev, dev->live_out->bEndpointAddress),
-              buf, cmd_len, write_bulk_callback, NULL/*context*/);
-    usb_anchor_urb(urb, &net->tx_submitted);
+    if (!filter->neff)
+        return 0;
 
-    err = usb_submit_urb(urb, GFP_ATOMIC);
-    if (unlikely(err)) 
+    // merge overlapping and adjacent ranges for the binary search in the RX path
+    sort(filter->eff, filter->neff, sizeof(filter->eff[0]), filter_cmp, NULL);
+    for (i = 1, n = 0; i < filter->neff; i++)
     {
-        spin_lock_irqsave(&net->tx_contexts_lock, flags);
-
-        #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0))
-            can_free_echo_skb(netdev, context->echo_index, NULL);
-        #else
-            can_free_echo_skb(netdev, context->echo_index);
-        #endif
-        //context->echo_index = USB_MAX_TX_URBS;
-        --net->active_tx_contexts;
-        netif_wake_queue(netdev);
-
-        spin_unlock_irqrestore(&net->tx_contexts_lock, flags);
+        if (filter->eff[i].from <= filter->eff[n].to + 1)
+            filter->eff[n].to = MAX(filter->eff[n].to, filter->eff[i].to);
+        else
+            filter->eff[++n] = filter->eff[i];
+    }
+    filter->neff = n + 1;
 
-        usb_unanchor_urb(urb);
-        kfree(buf);
+    return 0;
+}
 
-        stats->tx_dropped++;
+static ssize_t rx_filter_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct rexgen_net *net = netdev_priv(to_net_dev(d));
+    const struct rexgen_filter *filter;
+    unsigned int id, last, i;
+    ssize_t len = 0;
+
+    rcu_read_lock();
+    filter = rcu_dereference(net->filter);
+    if (!filter)
+    {
+        rcu_read_unlock();
+        return scnprintf(buf, PAGE_SIZE, "all\n");
+    }
 
-        if (err == -ENODEV)
-            netif_device_detach(netdev);
+    for (id = find_first_bit(filter->sff, CAN_SFF_MASK + 1); id <= CAN_SFF_MASK;
+         id = find_next_bit(filter->sff, CAN_SFF_MASK + 1, last + 1))
+    {
+        last = find_next_zero_bit(filter->sff, CAN_SFF_MASK + 1, id) - 1;
+        if (id == last)
+            len += scnprintf(buf + len, PAGE_SIZE - len, "%03x ", id);
         else
-            netdev_warn(netdev, "Failed tx_urb %d\n", err);
-
-        goto freeurb;
+            len += scnprintf(buf + len, PAGE_SIZE - len, "%03x-%03x ", id, last);
     }
 
-    ret = NETDEV_TX_OK;
+    for (i = 0; i < filter->neff; i++)
+    {
+        if (filter->eff[i].from == filter->eff[i].to)
+            len += scnprintf(buf + len, PAGE_SIZE - len, "%08x ", filter->eff[i].from);
+        else
+            len += scnprintf(buf + len, PAGE_SIZE - len, "%08x-%08x ",
+                    filter->eff[i].from, filter->eff[i].to);
+    }
+    rcu_read_unlock();
 
-freeurb:
-    usb_free_urb(urb);
-    return ret;
+    len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+    return len;
 }
 
-static int on_open(struct net_device *netdev)
+// "all" or an empty string removes the filter
+static ssize_t rx_filter_store(struct device *d, struct device_attribute *attr,
+        const char *buf, size_t count)
 {
-    struct rexgen_net *net = netdev_priv(netdev);
-    struct rexgen_usb *dev = net->dev;
-    int err;
-    unsigned short channel = net->channel;
+    struct rexgen_net *net = netdev_priv(to_net_dev(d));
+    struct rexgen_filter *filter = NULL, *old;
+    char *str, *ptr;
+    int err = 0;
 
-    err = open_candev(netdev);
-    if (err)
+    str = kstrndup(buf, count, GFP_KERNEL);
+    if (!str)
+        return -ENOMEM;
+
+    ptr = strim(str);
+    if (*ptr && strcmp(ptr, "all"))
     {
-        printk("%s: open_candev error %i", DeviceName, err);
-        goto error;
+        filter = kzalloc(sizeof(*filter), GFP_KERNEL);
+        if (!filter)
+            err = -ENOMEM;
+        else
+            err = parse_rx_filter(filter, ptr);
     }
+    kfree(str);
 
-    err = usb_get_firmware(dev);
     if (err)
     {
-       if (err == NOT_SUPPORTED)
-           printk("%s: Firmware not supports socket CAN", DeviceName);
-       else
-           printk("%s: Cannot get firmware", DeviceName);
-       return err;
-    }
-    else
-    {
-        printk("%s: Firmware %i.%i.%i.%i", DeviceName, dev->fw_ver[0], dev->fw_ver[1], dev->fw_ver[2], dev->fw_ver[3]);
+        kfree(filter);
+        return err;
     }
-    unsigned char flags = 0;
-    if (net->can.ctrlmode & CAN_CTRLMODE_LISTENONLY)
-        flags |= CAN_INTERFACE_LISTENONLY;
-    if (net->can.ctrlmode & CAN_CTRLMODE_LOOPBACK)
-        flags |= CAN_INTERFACE_LOOPBACK;
-    if (net->can.ctrlmode & CAN_CTRLMODE_FD)
-        flags |= CAN_INTERFACE_CAN_FD_ISO;
-    if (net->can.ctrlmode & CAN_CTRLMODE_FD_NON_ISO)
-        flags |= CAN_INTERFACE_CAN_FD_NON_ISO;
 
-    err = usb_can_bus_open(dev, channel, flags);
-    if (err)
+    // unregister_netdev() drains sysfs writers with rtnl held
+    if (!rtnl_trylock())
     {
-        printk("%s: Cannot open channel %i, error %i", DeviceName, net->channel, err);
-        goto error;
+        kfree(filter);
+        return restart_syscall();
     }
+    old = rtnl_dereference(net->filter);
+    rcu_assign_pointer(net->filter, filter);
+    rtnl_unlock();
 
-    /*usb_set_bittiming(netdev);
-    if (net->can.ctrlmode & CAN_CTRLMODE_FD)
-        usb_set_data_bittiming(netdev);*/
+    if (old)
+        kfree_rcu(old, rcu);
 
-    err = usb_can_bus_on(dev, channel);
-    if (err)
-    {
-        printk("%s: Cannot turn on channel %i, error %i", DeviceName, net->channel, err);
-        goto error;
-    }
+    return count;
+}
+static DEVICE_ATTR_RW(rx_filter);
 
-    err = setup_rx_urbs(dev);
-    if (err)
+static ssize_t rx_filtered_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct rexgen_net *net = netdev_priv(to_net_dev(d));
+
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", READ_ONCE(net->rx_filtered));
+}
+static DEVICE_ATTR_RO(rx_filtered);
+
+// ID ranges with their TX queue like "0-7f:0 18fef100-18fef1ff:1", see parse_id_range()
+static int parse_txq_map(struct rexgen_txq_map *map, char *str, unsigned int queues)
+{
+    struct rexgen_txq_range *range;
+    char *tok, *queue;
+
+    while ((tok = strsep(&str, " ,\n")) != NULL)
     {
-        printk("%s: Cannot setup rx urbs. Error %i", DeviceName, err);
-        goto error;
-    }
+        if (!*tok)
+            continue;
 
-    net->can.state = CAN_STATE_ERROR_ACTIVE;
+        if (map->count == USB_MAX_TXQ_RANGES)
+            return -ENOSPC;
+
+        range = &map->ranges[map->count];
+        queue = strchr(tok, ':');
+        if (!queue)
+            return -EINVAL;
+        *queue++ = 0;
+
+        if (parse_id_range(tok, &range->from, &range->to, &range->eff) ||
+            kstrtou16(queue, 10, &range->queue) || range->queue >= queues)
+            return -EINVAL;
+
+        map->count++;
+    }
 
     return 0;
+}
 
-error:
-    close_candev(netdev);
-    return err;
+static ssize_t tx_queue_map_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct rexgen_net *net = netdev_priv(to_net_dev(d));
+    const struct rexgen_txq_map *map;
+    const struct rexgen_txq_range *range;
+    unsigned int i;
+    ssize_t len = 0;
+
+    rcu_read_lock();
+    map = rcu_dereference(net->txq_map);
+    for (i = 0; map && i < map->count; i++)
+    {
+        range = &map->ranges[i];
+        if (range->from == range->to)
+            len += scnprintf(buf + len, PAGE_SIZE - len, range->eff ? "%08x:%u " : "%03x:%u ",
+                    range->from, range->queue);
+        else
+            len += scnprintf(buf + len, PAGE_SIZE - len,
+                    range->eff ? "%08x-%08x:%u " : "%03x-%03x:%u ",
+                    range->from, range->to, range->queue);
+    }
+    rcu_read_unlock();
+
+    len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+    return len;
 }
 
-static int on_close(struct net_device *netdev)
+// an empty string queues all frames by skb->priority again
+static ssize_t tx_queue_map_store(struct device *d, struct device_attribute *attr,
+        const char *buf, size_t count)
 {
+    struct net_device *netdev = to_net_dev(d);
     struct rexgen_net *net = netdev_priv(netdev);
-    struct rexgen_usb *dev = net->dev;
-    int err;
-    unsigned short channel = net->channel;
+    struct rexgen_txq_map *map = NULL, *old;
+    char *str, *ptr;
+    int err = 0;
 
-    err = usb_can_bus_off(dev, channel);
-    if (err)
+    str = kstrndup(buf, count, GFP_KERNEL);
+    if (!str)
+        return -ENOMEM;
+
+    ptr = strim(str);
+    if (*ptr)
     {
-        printk("%s: Cannot turn off channel %i, error %i", DeviceName, net->channel, err);
+        map = kzalloc(sizeof(*map), GFP_KERNEL);
+        if (!map)
+            err = -ENOMEM;
+        else
+            err = parse_txq_map(map, ptr, netdev->real_num_tx_queues);
     }
+    kfree(str);
 
-    err = usb_can_bus_close(dev, channel);
     if (err)
     {
-        printk("%s: Cannot close channel %i, error %i", DeviceName, net->channel, err);
+        kfree(map);
+        return err;
     }
 
-    printk("%s: Closing net socket...", DeviceName);
-    //netif_stop_queue(netdev);
-    unlink_tx_urbs(net);
-    net->can.state = CAN_STATE_STOPPED;
-    close_candev(net->netdev);
-    printk("%s: Socket closed!", DeviceName);
-    return 0;
-}
-
+    if (!rtnl_trylock())
+    {
+        kfree(map);
+        return restart_syscall();
+    }
+    old = rtnl_dereference(net->txq_map);
+    rcu_assign_pointer(net->txq_map, map);
+    rtnl_unlock();
 
-static void reset_tx_urb_contexts(struct rexgen_net *net)
-{
-    int i;
+    if (old)
+        kfree_rcu(old, rcu);
 
-    net->active_tx_contexts = 0;
-    for (i = 0; i < USB_MAX_TX_URBS; i++)
-        net->tx_contexts[i].echo_index = USB_MAX_TX_URBS;
+    return count;
 }
-
-static const struct net_device_ops rex_ops = {
-    .ndo_open = on_open,
-    .ndo_stop = on_close,
-    .ndo_start_xmit = on_xmit,
-    .ndo_change_mtu = can_change_mtu,
+static DEVICE_ATTR_RW(tx_queue_map);
+
+static struct attribute *rexgen_net_attrs[] = {
+    &dev_attr_rx_filter.attr,
+    &dev_attr_rx_filtered.attr,
+    &dev_attr_tx_queue_map.attr,
+    &dev_attr_tx_cyclic.attr,
+    NULL,
 };
 
-static int get_berr_counter(const struct net_device *netdev, struct can_berr_counter *bec)
-{
-    struct rexgen_net *net = netdev_priv(netdev);
-    *bec = net->bec;
-    return 0;
-}
+static const struct attribute_group rexgen_net_group = {
+    .attrs = rexgen_net_attrs,
+};
 
 static int init_interface(struct rexgen_usb *dev, const struct usb_device_id *id, int channel)
 {
     struct net_device *netdev;
     struct rexgen_net *net;
-    int err;
+    int cpu, err;
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0))
-    netdev = alloc_candev(struct_size(net, tx_contexts, USB_MAX_TX_URBS), USB_MAX_TX_URBS);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+    netdev = alloc_candev_mqs(struct_size(net, tx_contexts, USB_TX_CONTEXTS), USB_MAX_TX_ECHO,
+                              USB_TX_QUEUES, 1);
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0))
+    netdev = alloc_candev(struct_size(net, tx_contexts, USB_TX_CONTEXTS), USB_MAX_TX_ECHO);
 #else
-    netdev = alloc_candev(sizeof(*net) + USB_MAX_TX_URBS * sizeof(*net->tx_contexts), USB_MAX_TX_URBS);
+    netdev = alloc_candev(sizeof(*net) + USB_TX_CONTEXTS * sizeof(*net->tx_contexts), USB_MAX_TX_ECHO);
 #endif
 
     if (!netdev) {
@@ -624,7 +1638,26 @@ static int init_interface(struct rexgen_usb *dev, const struct usb_device_id *id
 
     net = netdev_priv(netdev);
 
+    net->stats = alloc_percpu(struct rexgen_pcpu_stats);
+    net->hist = alloc_percpu(struct rexgen_net_hist);
+    if (!net->stats || !net->hist) {
+	   free_percpu(net->stats);
+	   free_percpu(net->hist);
+	   free_candev(netdev);
+	   return -ENOMEM;
+    }
+
+    // RX and TX counters have separate writers, each needs its own seqcount
+    for_each_possible_cpu(cpu) {
+        struct rexgen_pcpu_stats *stats = per_cpu_ptr(net->stats, cpu);
+
+        u64_stats_init(&stats->rx_syncp);
+        u64_stats_init(&stats->tx_syncp);
+    }
+
     init_usb_anchor(&net->tx_submitted);
+    spin_lock_init(&net->tx_lock);
+    rexgen_cyclic_init(net);
     init_completion(&net->start_comp);
     init_completion(&net->stop_comp);
     net->can.ctrlmode_supported = 
@@ -632,20 +1665,22 @@ static int init_interface(struct rexgen_usb *dev, const struct usb_device_id *id
         CAN_CTRLMODE_LOOPBACK | 
         CAN_CTRLMODE_FD | 
         CAN_CTRLMODE_FD_NON_ISO;
+    // bus errors and the error counters only come with the ERR records
+    if (err_records_supported(dev))
+        net->can.ctrlmode_supported |= CAN_CTRLMODE_BERR_REPORTING;
 
     net->dev = dev;
     net->netdev = netdev;
     net->channel = channel;
-    net->echoskb = NULL;
-
-    spin_lock_init(&net->tx_contexts_lock);
     reset_tx_urb_contexts(net);
     
     net->can.state = CAN_STATE_STOPPED;
     net->can.clock.freq = rex_usb_cfg.clock.freq;
     net->can.bittiming_const = rex_usb_cfg.bittiming_const;
     net->can.do_set_bittiming = usb_set_bittiming;
-    net->can.do_get_berr_counter = get_berr_counter;
+    if (err_records_supported(dev))
+        net->can.do_get_berr_counter = get_berr_counter;
+    net->can.do_set_mode = set_mode;
     if (net->can.ctrlmode_supported & CAN_CTRLMODE_FD) {
         net->can.data_bittiming_const = rex_usb_cfg.data_bittiming_const;
         net->can.do_set_data_bittiming = usb_set_data_bittiming;
@@ -653,6 +1688,8 @@ static int init_interface(struct rexgen_usb *dev, const struct usb_device_id *id
 
     netdev->flags = IFF_NOARP | IFF_ECHO | IFF_LOOPBACK;
     netdev->netdev_ops = &rex_ops;
+    netdev->ethtool_ops = &rex_ethtool_ops;
+    netdev->sysfs_groups[0] = &rexgen_net_group;
 
     SET_NETDEV_DEV(netdev, &dev->intf->dev);
     netdev->dev_id = channel;
@@ -663,6 +1700,8 @@ static int init_interface(struct rexgen_usb *dev, const struct usb_device_id *id
     err = register_candev(netdev);
     if (err) {
 	   printk("%s: Failed to register CAN device", DeviceName);
+	   free_percpu(net->stats);
+	   free_percpu(net->hist);
 	   free_candev(netdev);
 	   dev->nets[channel] = NULL;
 	   return err;
@@ -676,18 +1715,49 @@ static int init_interface(struct rexgen_usb *dev, const struct usb_device_id *id
 
 static void unlink_tx_urbs(struct rexgen_net *net)
 {
+    unsigned int i;
+
     usb_kill_anchored_urbs(&net->tx_submitted);
+
+    // frames still waiting for a device confirmation, the killed URBs of
+    // loopback mode have counted theirs and left the slots to us
+    for (i = net->echo_tail; i != net->echo_head; i++)
+    {
+        free_tx_echo(net, i % USB_MAX_TX_ECHO);
+        if (!net->tx_echo[i % USB_MAX_TX_ECHO].failed)
+            rexgen_tx_stats(net, 0, 0, 0, 1);
+    }
+    net->echo_failed = false;
+
     reset_tx_urb_contexts(net);
+    for (i = 0; i < net->netdev->num_tx_queues; i++)
+        netdev_tx_reset_queue(netdev_get_tx_queue(net->netdev, i));
 }
 
 static void unlink_all_urbs(struct rexgen_usb *dev)
 {
     int i;
 
+    // no new halt work after this, a running one may still resubmit, so
+    // kill again once it is done and drop the URBs still parked
+    WRITE_ONCE(dev->rx_stopping, true);
     usb_kill_anchored_urbs(&dev->rx_submitted);
+    cancel_work_sync(&dev->rx_halt_work);
+    usb_kill_anchored_urbs(&dev->rx_submitted);
+    usb_scuttle_anchored_urbs(&dev->rx_halted);
+
+    // no more completions, wait for a scheduling IPI still in flight
+    while (test_bit(0, &dev->rx_ipi))
+        cpu_relax();
 
-    for (i = 0; i < USB_MAX_RX_URBS; i++)
-	   usb_free_coherent(dev->udev, USB_RX_BUFFER_SIZE, dev->rxbuf[i], dev->rxbuf_dma[i]);
+    // drop URBs completed but never picked up by the NAPI poll
+    while (dev->rx_done_tail != dev->rx_done_head)
+        usb_put_urb(dev->rx_done[dev->rx_done_tail++ % USB_MAX_RX_URBS]);
+    dev->rx_block = 0;
+    dev->rx_pos = 0;
+
+    for (i = 0; i < dev->rx_urb_count; i++)
+	   usb_free_coherent(dev->udev, dev->rx_buffer_size, dev->rxbuf[i], dev->rxbuf_dma[i]);
 
     for (i = 0; i < dev->nchannels; i++) {
 	   struct rexgen_net *net = dev->nets[i];
@@ -700,6 +1770,15 @@ static void remove_interfaces(struct rexgen_usb *dev)
 {
     int i;
 
+    rexgen_debugfs_remove_device(dev);
+
+    if (dev->napienabled)
+    {
+        napi_disable(&dev->napi);
+        netif_napi_del(&dev->napi);
+        dev->napienabled = false;
+    }
+
     for (i = 0; i < dev->nchannels; i++) {
 	   if (!dev->nets[i])
 	       continue;
@@ -708,24 +1787,133 @@ static void remove_interfaces(struct rexgen_usb *dev)
     }
 
     unlink_all_urbs(dev);
+    usb_stop_timestamp(dev);
 
     for (i = 0; i < dev->nchannels; i++) {
 	   if (!dev->nets[i])
 	       continue;
 
+	   kfree(rcu_dereference_protected(dev->nets[i]->filter, 1));
+	   kfree(rcu_dereference_protected(dev->nets[i]->txq_map, 1));
+	   rexgen_cyclic_free(dev->nets[i]);
+	   free_percpu(dev->nets[i]->stats);
+	   free_percpu(dev->nets[i]->hist);
 	   free_candev(dev->nets[i]->netdev);
     }
+
+    usb_cmd_cleanup(dev);
+}
+
+// device information cached at probe, read-only in sysfs on the USB interface
+static ssize_t firmware_version_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct rexgen_usb *dev = usb_get_intfdata(to_usb_interface(d));
+
+    if (!dev)
+        return -ENODEV;
+
+    return scnprintf(buf, PAGE_SIZE, "%u.%u.%u.%u\n",
+            dev->fw_ver[0], dev->fw_ver[1], dev->fw_ver[2], dev->fw_ver[3]);
+}
+static DEVICE_ATTR_RO(firmware_version);
+
+static ssize_t channels_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct rexgen_usb *dev = usb_get_intfdata(to_usb_interface(d));
+
+    if (!dev)
+        return -ENODEV;
+
+    return scnprintf(buf, PAGE_SIZE, "%u\n", dev->nchannels);
+}
+static DEVICE_ATTR_RO(channels);
+
+// one line per channel: channel, RX, TX and error block UID
+static ssize_t block_uids_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct rexgen_usb *dev = usb_get_intfdata(to_usb_interface(d));
+    ssize_t len = 0;
+    int i;
+
+    if (!dev)
+        return -ENODEV;
+
+    for (i = 0; i < dev->nchannels; i++)
+    {
+        struct rexgen_net *net = dev->nets[i];
+
+        if (!net)
+            continue;
+
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%d %u %u %u\n", i,
+                net->usb_block_uid[IDX_CAN_BLOCK_UID_RX],
+                net->usb_block_uid[IDX_CAN_BLOCK_UID_TX],
+                net->usb_block_uid[IDX_CAN_BLOCK_UID_ERR]);
+    }
+
+    return len;
 }
+static DEVICE_ATTR_RO(block_uids);
+
+// CPU the live data of the device is parsed and delivered on, -1 for the CPU
+// the USB host controller completes the URBs on
+static ssize_t rx_cpu_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct rexgen_usb *dev = usb_get_intfdata(to_usb_interface(d));
+
+    if (!dev)
+        return -ENODEV;
+
+    return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(dev->rx_cpu));
+}
+
+static ssize_t rx_cpu_store(struct device *d, struct device_attribute *attr,
+        const char *buf, size_t count)
+{
+    struct rexgen_usb *dev = usb_get_intfdata(to_usb_interface(d));
+    int cpu, err;
+
+    if (!dev)
+        return -ENODEV;
+
+    err = kstrtoint(buf, 0, &cpu);
+    if (err)
+        return err;
+
+    if (cpu < -1 || cpu >= (int)nr_cpu_ids || (cpu >= 0 && !cpu_online(cpu)))
+        return -EINVAL;
+
+    WRITE_ONCE(dev->rx_cpu, cpu);
+    return count;
+}
+static DEVICE_ATTR_RW(rx_cpu);
+
+static struct attribute *rexgen_dev_attrs[] = {
+    &dev_attr_firmware_version.attr,
+    &dev_attr_channels.attr,
+    &dev_attr_block_uids.attr,
+    &dev_attr_rx_cpu.attr,
+    NULL,
+};
+
+static const struct attribute_group rexgen_dev_group = {
+    .attrs = rexgen_dev_attrs,
+};
 
 static int probe(struct usb_interface *intf, const struct usb_device_id *id)
 {
     struct rexgen_usb *dev;
+    ktime_t start = ktime_get();
     int err, i;
 
     dev = devm_kzalloc(&intf->dev, sizeof(*dev), GFP_KERNEL);
     if (!dev)
         return -ENOMEM;
 
+    dev->xstats = devm_alloc_percpu(&intf->dev, struct rexgen_usb_xstats);
+    if (!dev->xstats)
+        return -ENOMEM;
+
     dev->intf = intf;
     err = setup_endpoints(dev);
     if (err)
@@ -738,8 +1926,30 @@ static int probe(struct usb_interface *intf, const struct usb_device_id *id)
     
     dev->udev = interface_to_usbdev(intf);
     init_usb_anchor(&dev->rx_submitted);
+    init_usb_anchor(&dev->rx_halted);
+    INIT_WORK(&dev->rx_halt_work, rx_halt_work);
+    setup_rx_size(dev);
+    spin_lock_init(&dev->rx_done_lock);
+    dev->rx_cpu = -1;
+    if (spread_cpus)
+        dev->rx_cpu = cpumask_local_spread(atomic_inc_return(&next_rx_cpu) - 1,
+                                           dev_to_node(&intf->dev));
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0))
+    INIT_CSD(&dev->rx_csd, rx_ipi_func, dev);
+#else
+    dev->rx_csd.func = rx_ipi_func;
+    dev->rx_csd.info = dev;
+#endif
+    usb_init_timestamp(dev);
     usb_set_intfdata(intf, dev);
 
+    err = usb_cmd_init(dev);
+    if (err)
+    {
+        printk("%s: Cannot start command engine", DeviceName);
+        return err;
+    }
+
     err = usb_get_firmware(dev);
     if (err)
     {
@@ -747,6 +1957,7 @@ static int probe(struct usb_interface *intf, const struct usb_device_id *id)
 	       printk("%s: Firmware not supports socket CAN", DeviceName);
 	   else
 	       printk("%s: Cannot get firmware", DeviceName);
+	   usb_cmd_cleanup(dev);
 	   return err;
     }
     else
@@ -758,6 +1969,7 @@ static int probe(struct usb_interface *intf, const struct usb_device_id *id)
     if (err) 
     {
 	   printk("%s: Cannot get number of channels", DeviceName);
+	   usb_cmd_cleanup(dev);
 	   return err;
     }
     else
@@ -765,6 +1977,14 @@ static int probe(struct usb_interface *intf, const struct usb_device_id *id)
         printk("%s: Detected %u channels", DeviceName, dev->nchannels);
     }
 
+    if (dev->nchannels)
+        dev->nets = devm_kcalloc(&intf->dev, dev->nchannels, sizeof(*dev->nets), GFP_KERNEL);
+    if (!dev->nets)
+    {
+       usb_cmd_cleanup(dev);
+       return dev->nchannels ? -ENOMEM : -ENODEV;
+    }
+
     for (i = 0; i < dev->nchannels; i++) 
     {
 	   err = init_interface(dev, id, i);
@@ -776,10 +1996,21 @@ static int probe(struct usb_interface *intf, const struct usb_device_id *id)
 	   }
     }
 
+    // a single NAPI context per device, hosted by the first channel, parses the
+    // live data blocks of all channels
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0))
+    netif_napi_add(dev->nets[0]->netdev, &dev->napi, rx_poll);
+#else
+    netif_napi_add(dev->nets[0]->netdev, &dev->napi, rx_poll, NAPI_POLL_WEIGHT);
+#endif
+    napi_enable(&dev->napi);
+    dev->napienabled = true;
+
     err = usb_can_intf_enable(dev);
     if (err)
     {
        printk("%s: Cannot enable interface", DeviceName);
+       remove_interfaces(dev);
        return err;
     }
     else
@@ -791,6 +2022,7 @@ static int probe(struct usb_interface *intf, const struct usb_device_id *id)
     if (err)
     {
        printk("%s: Cannot start live data", DeviceName);
+       remove_interfaces(dev);
        return err;
     }
     else
@@ -798,6 +2030,14 @@ static int probe(struct usb_interface *intf, const struct usb_device_id *id)
         printk("%s: Live data started", DeviceName);
     }
 
+    rexgen_debugfs_add_device(dev);
+
+    if (sysfs_create_group(&intf->dev.kobj, &rexgen_dev_group))
+        dev_warn(&intf->dev, "Cannot create sysfs attributes\n");
+    else
+        dev->sysfsdone = true;
+
+    dev_info(&intf->dev, "Probe done in %lld us\n", ktime_us_delta(ktime_get(), start));
     return SUCCESS;
 }
 
@@ -810,6 +2050,9 @@ static void disconnect(struct usb_interface *intf)
     if (!dev)
     	return;
 
+    if (dev->sysfsdone)
+        sysfs_remove_group(&intf->dev.kobj, &rexgen_dev_group);
+
     remove_interfaces(dev);    
     printk("%s: Disconnected", DeviceName);
 }
@@ -822,4 +2065,24 @@ static struct usb_driver rexgen_usb_driver = {
     .id_table = influx_usb_table,
 };
 
-module_usb_driver(rexgen_usb_driver);
+static int __init rexgen_init(void)
+{
+    int err;
+
+    rexgen_debugfs_init();
+
+    err = usb_register(&rexgen_usb_driver);
+    if (err)
+        rexgen_debugfs_exit();
+
+    return err;
+}
+
+static void __exit rexgen_exit(void)
+{
+    usb_deregister(&rexgen_usb_driver);
+    rexgen_debugfs_exit();
+}
+
+module_init(rexgen_init);
+module_exit(rexgen_exit);
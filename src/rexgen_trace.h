@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-2.0
+/* 
+    USB to SocketCAN driver for ReXgen
+    Copyright (C) 1999-2021 Influx Technology LTD, UK. All rights reserved.
+    Contacts: https://www.influxtechnology.com/contact
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Tracepoints of the RX, TX and command paths, e.g.
+//     perf record -e 'rexgen:*'
+//     echo 1 > /sys/kernel/tracing/events/rexgen/enable
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rexgen
+
+#if !defined(_REXGEN_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _REXGEN_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "rexgen_def.h"
+
+#define REXGEN_TRACE_NAME_LEN 32
+
+TRACE_EVENT(rexgen_rx_urb,
+    TP_PROTO(const struct rexgen_usb *dev, const struct urb *urb),
+    TP_ARGS(dev, urb),
+
+    TP_STRUCT__entry(
+        __array(char, name, REXGEN_TRACE_NAME_LEN)
+        __field(int, status)
+        __field(u32, len)
+    ),
+
+    TP_fast_assign(
+        strscpy(__entry->name, dev_name(&dev->intf->dev), REXGEN_TRACE_NAME_LEN);
+        __entry->status = urb->status;
+        __entry->len = urb->actual_length;
+    ),
+
+    TP_printk("%s status=%d len=%u", __entry->name, __entry->status, __entry->len)
+);
+
+TRACE_EVENT(rexgen_rx_record,
+    TP_PROTO(const struct rexgen_usb *dev, const usb_record *rec),
+    TP_ARGS(dev, rec),
+
+    TP_STRUCT__entry(
+        __array(char, name, REXGEN_TRACE_NAME_LEN)
+        __field(u16, uid)
+        __field(u8, infsize)
+        __field(u8, dlc)
+        __field(u32, timestamp)
+        __field(u32, can_id)
+        __field(u8, flags)
+    ),
+
+    TP_fast_assign(
+        strscpy(__entry->name, dev_name(&dev->intf->dev), REXGEN_TRACE_NAME_LEN);
+        __entry->uid = rec->uid;
+        __entry->infsize = rec->infsize;
+        __entry->dlc = rec->dlc;
+        __entry->timestamp = rec->infsize >= 4 ? get_unaligned_le32(rec->inf) : 0;
+        __entry->can_id = rec->infsize >= 8 ? get_unaligned_le32(rec->inf + 4) : 0;
+        __entry->flags = rec->infsize >= 9 ? rec->inf[8] : 0;
+    ),
+
+    TP_printk("%s uid=%u inf=%u dlc=%u ts=%u id=0x%x flags=0x%x", __entry->name,
+        __entry->uid, __entry->infsize, __entry->dlc, __entry->timestamp,
+        __entry->can_id, __entry->flags)
+);
+
+TRACE_EVENT(rexgen_xmit,
+    TP_PROTO(const struct net_device *netdev, canid_t can_id, u8 len, u32 echo_index),
+    TP_ARGS(netdev, can_id, len, echo_index),
+
+    TP_STRUCT__entry(
+        __array(char, name, IFNAMSIZ)
+        __field(u32, can_id)
+        __field(u8, len)
+        __field(u32, echo_index)
+    ),
+
+    TP_fast_assign(
+        memcpy(__entry->name, netdev->name, IFNAMSIZ);
+        __entry->can_id = can_id;
+        __entry->len = len;
+        __entry->echo_index = echo_index;
+    ),
+
+    TP_printk("%s id=0x%x len=%u echo=%u", __entry->name, __entry->can_id,
+        __entry->len, __entry->echo_index)
+);
+
+DECLARE_EVENT_CLASS(rexgen_tx_urb,
+    TP_PROTO(const struct net_device *netdev, const struct usb_tx_context *context, int status),
+    TP_ARGS(netdev, context, status),
+
+    TP_STRUCT__entry(
+        __array(char, name, IFNAMSIZ)
+        __field(u32, echo_index)
+        __field(u32, frames)
+        __field(u32, len)
+        __field(int, status)
+    ),
+
+    TP_fast_assign(
+        memcpy(__entry->name, netdev->name, IFNAMSIZ);
+        __entry->echo_index = context->echo_index;
+        __entry->frames = context->frames;
+        __entry->len = context->len;
+        __entry->status = status;
+    ),
+
+    TP_printk("%s echo=%u frames=%u len=%u status=%d", __entry->name,
+        __entry->echo_index, __entry->frames, __entry->len, __entry->status)
+);
+
+DEFINE_EVENT(rexgen_tx_urb, rexgen_tx_submit,
+    TP_PROTO(const struct net_device *netdev, const struct usb_tx_context *context, int status),
+    TP_ARGS(netdev, context, status)
+);
+
+DEFINE_EVENT(rexgen_tx_urb, rexgen_tx_complete,
+    TP_PROTO(const struct net_device *netdev, const struct usb_tx_context *context, int status),
+    TP_ARGS(netdev, context, status)
+);
+
+TRACE_EVENT(rexgen_echo,
+    TP_PROTO(const struct net_device *netdev, canid_t can_id, u32 echo_index, u32 skipped),
+    TP_ARGS(netdev, can_id, echo_index, skipped),
+
+    TP_STRUCT__entry(
+        __array(char, name, IFNAMSIZ)
+        __field(u32, can_id)
+        __field(u32, echo_index)
+        __field(u32, skipped)
+    ),
+
+    TP_fast_assign(
+        memcpy(__entry->name, netdev->name, IFNAMSIZ);
+        __entry->can_id = can_id;
+        __entry->echo_index = echo_index;
+        __entry->skipped = skipped;
+    ),
+
+    TP_printk("%s id=0x%x echo=%u skipped=%u", __entry->name, __entry->can_id,
+        __entry->echo_index, __entry->skipped)
+);
+
+TRACE_EVENT(rexgen_cmd_send,
+    TP_PROTO(const struct usb_cmd_slot *slot),
+    TP_ARGS(slot),
+
+    TP_STRUCT__entry(
+        __array(char, name, REXGEN_TRACE_NAME_LEN)
+        __field(u8, seq)
+        __field(u8, cmd)
+        __field(u32, len)
+    ),
+
+    TP_fast_assign(
+        strscpy(__entry->name, dev_name(&slot->dev->intf->dev), REXGEN_TRACE_NAME_LEN);
+        __entry->seq = slot->seq;
+        __entry->cmd = slot->tx_data[3];
+        __entry->len = slot->tx_len;
+    ),
+
+    TP_printk("%s seq=%u cmd=0x%02x len=%u", __entry->name, __entry->seq,
+        __entry->cmd, __entry->len)
+);
+
+TRACE_EVENT(rexgen_cmd_response,
+    TP_PROTO(const struct usb_cmd_slot *slot, u64 rtt_ns),
+    TP_ARGS(slot, rtt_ns),
+
+    TP_STRUCT__entry(
+        __array(char, name, REXGEN_TRACE_NAME_LEN)
+        __field(u8, seq)
+        __field(u8, cmd)
+        __field(u32, len)
+        __field(u64, rtt_ns)
+    ),
+
+    TP_fast_assign(
+        strscpy(__entry->name, dev_name(&slot->dev->intf->dev), REXGEN_TRACE_NAME_LEN);
+        __entry->seq = slot->seq;
+        __entry->cmd = slot->rx_len > 3 ? slot->rx_data[3] : 0;
+        __entry->len = slot->rx_len;
+        __entry->rtt_ns = rtt_ns;
+    ),
+
+    TP_printk("%s seq=%u cmd=0x%02x len=%u rtt=%lluns", __entry->name, __entry->seq,
+        __entry->cmd, __entry->len, __entry->rtt_ns)
+);
+
+#endif // _REXGEN_TRACE_H
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rexgen_trace
+#include <trace/define_trace.h>
@@ -21,106 +21,382 @@
 
 #include <linux/version.h>
 #include "rexgen_def.h"
+#include "rexgen_trace.h"
 
-unsigned char Seq;
+static unsigned int cmd_timeout = USB_CMD_TIMEOUT;
+module_param(cmd_timeout, uint, 0644);
+MODULE_PARM_DESC(cmd_timeout, "Command response timeout per attempt in ms (default 250)");
 
-static int usb_send_cmd(const struct rexgen_usb *dev, void *cmd, int len)
+static unsigned int cmd_retries = USB_CMD_RETRIES;
+module_param(cmd_retries, uint, 0644);
+MODULE_PARM_DESC(cmd_retries, "Command retries after a timeout or a transfer error (default 3)");
+
+// The ERR record layout in rexgen_proto.h is not taken from a firmware
+// specification; it is only decoded on firmware known to send it that way.
+static char err_records_fw[16];
+module_param_string(err_records_fw, err_records_fw, sizeof(err_records_fw), 0444);
+MODULE_PARM_DESC(err_records_fw, "Lowest firmware version (major.minor.patch) whose ERR records are decoded, empty disables (default)");
+
+static void build_cmd(struct usb_cmd_slot *slot, const cmd_struct *cmdstruct,
+        const unsigned char *args, unsigned int nargs)
 {
-    int actual_len;
+    // sequence byte and checksum are filled in by usb_cmd_send
+    slot->tx_len = build_cmd_frame(slot->tx_data, cmdstruct->cmd_data, cmdstruct->tx_len, args, nargs);
+    slot->rx_len = 0;
+}
 
-    if (!usb_bulk_msg(dev->udev,
-            usb_sndbulkpipe(dev->udev, dev->bulk_out->bEndpointAddress),
-            cmd, len, &actual_len, USB_TIMEOUT))
-        return SUCCESS;
+static void write_cmd_callback(struct urb *urb)
+{
+    struct usb_cmd_slot *slot = urb->context;
+    struct rexgen_usb *dev = slot->dev;
+    unsigned long flags;
+
+    if (!urb->status)
+        return;
 
-    printk("%s: TX error ", DeviceName);
-    return USB_COMMUNICATION_ERROR;
+    spin_lock_irqsave(&dev->cmd_lock, flags);
+    if (slot->pending)
+    {
+        slot->pending = false;
+        slot->status = USB_COMMUNICATION_ERROR;
+        complete(&slot->done);
+    }
+    spin_unlock_irqrestore(&dev->cmd_lock, flags);
 }
 
-static int usb_recv_cmd(const struct rexgen_usb *dev, void *cmd, int len, int *actual_len)
+static void read_cmd_callback(struct urb *urb)
 {
-    int res;
+    struct rexgen_usb *dev = urb->context;
+    struct usb_cmd_slot *slot = NULL, *oldest = NULL;
+    const unsigned char *data = urb->transfer_buffer;
+    unsigned long flags;
+    int i, err;
+
+    // every later command depends on this URB, only unlink and disconnect end it
+    switch (urb->status) {
+    case 0:
+        break;
+    case -ENOENT:
+    case -ECONNRESET:
+    case -ESHUTDOWN:
+        return;
+    case -EPIPE:
+        // clearing the halt sleeps, the work item resubmits
+        dev_warn_ratelimited(&dev->intf->dev, "Command RX endpoint stalled\n");
+        schedule_work(&dev->cmd_halt_work);
+        return;
+    default:
+        // -EPROTO, -EILSEQ, ...: a transient bus error, the commands waiting
+        // for the lost response are retried by usb_cmd_wait
+        dev_info_ratelimited(&dev->intf->dev, "Command RX URB aborted (%d)\n", urb->status);
+        goto resubmit;
+    }
 
-    res = usb_bulk_msg(dev->udev,
-            usb_rcvbulkpipe(dev->udev, dev->bulk_in->bEndpointAddress),
-            cmd, len, actual_len, USB_TIMEOUT);
+    if (!urb->actual_length)
+        goto resubmit;
 
-    switch(res)
+    spin_lock_irqsave(&dev->cmd_lock, flags);
+    for (i = 0; i < USB_CMD_SLOTS; i++)
     {
-        case SUCCESS:
-            return SUCCESS;
-        case -ETIMEDOUT:
-            printk("%s: RX Timeout, %i", DeviceName, res);
-            break;
-        default:
-            printk("%s: RX error %i", DeviceName, res);
-            break;
+        struct usb_cmd_slot *s = &dev->cmd_slots[i];
+
+        if (!s->pending)
+            continue;
+
+        if (s->seq == data[0])
+            slot = s;
+
+        if (!oldest || (int)(s->order - oldest->order) < 0)
+            oldest = s;
+    }
+
+    // until the firmware has been seen echoing the sequence byte several times
+    // in a row, assume it answers in order: byte 0 of a firmware that does not
+    // echo it may hit a pending sequence by chance. Afterwards an unknown
+    // sequence is a late response to a command that already timed out and is
+    // dropped.
+    if (dev->cmd_seq_matches < USB_CMD_SEQ_MATCHES)
+    {
+        if (slot && slot == oldest)
+            dev->cmd_seq_matches++;
+        else
+            dev->cmd_seq_matches = 0;
+
+        if (dev->cmd_seq_matches < USB_CMD_SEQ_MATCHES)
+            slot = oldest;
+    }
+
+    if (slot)
+    {
+        slot->rx_len = MIN(urb->actual_length, USB_CMD_BUFFER_SIZE);
+        memcpy(slot->rx_data, data, slot->rx_len);
+        trace_rexgen_cmd_response(slot, ktime_get_ns() - slot->sent_ns);
+        slot->status = SUCCESS;
+        slot->pending = false;
+        complete(&slot->done);
+    }
+    spin_unlock_irqrestore(&dev->cmd_lock, flags);
+
+resubmit:
+    err = usb_submit_urb(urb, GFP_ATOMIC);
+    if (err && err != -ENODEV)
+        dev_err(&dev->intf->dev, "Failed resubmitting command RX URB: %d\n", err);
+}
+
+static void cmd_halt_work(struct work_struct *work)
+{
+    struct rexgen_usb *dev = container_of(work, struct rexgen_usb, cmd_halt_work);
+    int err;
+
+    err = usb_clear_halt(dev->udev, dev->cmd_rx_urb->pipe);
+    if (err && err != -ENODEV)
+        dev_err(&dev->intf->dev, "Cannot clear command RX halt: %d\n", err);
+
+    // fails with -EPERM once usb_cmd_cleanup has poisoned the URB
+    err = usb_submit_urb(dev->cmd_rx_urb, GFP_KERNEL);
+    if (err && err != -ENODEV && err != -EPERM)
+        dev_err(&dev->intf->dev, "Failed resubmitting command RX URB: %d\n", err);
+}
+
+// (re)sends the command of the slot with a new sequence byte, so a late
+// response to an earlier attempt cannot complete it
+static void usb_cmd_send(struct usb_cmd_slot *slot)
+{
+    struct rexgen_usb *dev = slot->dev;
+    unsigned long flags;
+    int err;
+
+    spin_lock_irqsave(&dev->cmd_lock, flags);
+    slot->seq = dev->cmd_seq++;
+    slot->tx_data[0] = slot->seq;
+    build_check_sum(slot->tx_data, slot->tx_len);
+    slot->order = dev->cmd_order++;
+    slot->sent_ns = ktime_get_ns();
+    slot->status = USB_COMMUNICATION_ERROR;
+    slot->pending = true;
+    reinit_completion(&slot->done);
+    spin_unlock_irqrestore(&dev->cmd_lock, flags);
+
+    trace_rexgen_cmd_send(slot);
+    this_cpu_inc(dev->xstats->cmd_sent);
+    usb_fill_bulk_urb(slot->urb, dev->udev,
+            usb_sndbulkpipe(dev->udev, dev->bulk_out->bEndpointAddress),
+            slot->tx_data, slot->tx_len, write_cmd_callback, slot);
+
+    err = usb_submit_urb(slot->urb, GFP_KERNEL);
+    if (err)
+    {
+        printk("%s: TX error %i", DeviceName, err);
+
+        spin_lock_irqsave(&dev->cmd_lock, flags);
+        slot->pending = false;
+        complete(&slot->done);
+        spin_unlock_irqrestore(&dev->cmd_lock, flags);
     }
-    return USB_COMMUNICATION_ERROR;
 }
 
-static void build_check_sum(unsigned char* data, unsigned short count)
+static struct usb_cmd_slot *usb_cmd_get_slot(struct rexgen_usb *dev)
 {
+    struct usb_cmd_slot *slot = NULL;
+    unsigned long flags;
     int i;
-    unsigned char* crc = data + count - 1;
 
-    *crc = 0;
-    for (i = 0; i < count - 1; i++)
-        *crc += data[i];
+    spin_lock_irqsave(&dev->cmd_lock, flags);
+    for (i = 0; i < USB_CMD_SLOTS; i++)
+    {
+        if (!dev->cmd_slots[i].busy)
+        {
+            slot = &dev->cmd_slots[i];
+            slot->busy = true;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&dev->cmd_lock, flags);
+
+    return slot;
 }
 
-static void build_cmd(struct rexgen_cmd *cmd, const cmd_struct *cmdstruct)
+// queues a command without waiting for the response, several commands may be
+// in flight; every returned slot must be passed to usb_cmd_wait and released
+struct usb_cmd_slot *usb_cmd_submit(struct rexgen_usb *dev, const cmd_struct *cmdstruct,
+        const unsigned char *args, unsigned int nargs)
 {
-    unsigned short len = cmdstruct->tx_len + 4;
-    cmd->tx_data[0] = Seq++;
-    memcpy(&cmd->tx_data[1], &len, sizeof(len));
-    memcpy(&cmd->tx_data[3], cmdstruct->cmd_data, cmdstruct->tx_len);
-    build_check_sum((unsigned char*)cmd->tx_data, len);
-    cmd->tx_len = len;
-    cmd->rx_len = cmdstruct->rx_len;
+    struct usb_cmd_slot *slot = NULL;
+
+    wait_event_timeout(dev->cmd_wq, (slot = usb_cmd_get_slot(dev)) != NULL,
+            msecs_to_jiffies(USB_TIMEOUT));
+    if (!slot)
+    {
+        printk("%s: No free command slot", DeviceName);
+        return NULL;
+    }
+
+    build_cmd(slot, cmdstruct, args, nargs);
+    usb_cmd_send(slot);
+
+    return slot;
 }
 
-static int send_cmd_usb(struct rexgen_usb *dev, const cmd_struct *cmdstruct)
+int usb_cmd_wait(struct usb_cmd_slot *slot)
 {
-    struct rexgen_cmd *cmd;
-    int res, actual_len;
-    
-    cmd = kzalloc(sizeof(*cmd), GFP_KERNEL);
-    if (!cmd)
-        return -ENOMEM;
+    struct rexgen_usb *dev = slot->dev;
+    unsigned int attempt;
+    unsigned long flags;
+    bool timedout;
 
-    build_cmd(cmd, cmdstruct);
-    memset(&dev->usb_rx_data, 0, sizeof(dev->usb_rx_data));
+    for (attempt = 0; ; attempt++)
+    {
+        wait_for_completion_timeout(&slot->done, msecs_to_jiffies(cmd_timeout));
 
-    printktx(cmd);
-    res = usb_send_cmd(dev, cmd->tx_data, cmd->tx_len);
-    if (res)
-        goto end;
+        // a response racing with the timeout still counts
+        spin_lock_irqsave(&dev->cmd_lock, flags);
+        timedout = slot->pending;
+        slot->pending = false;
+        spin_unlock_irqrestore(&dev->cmd_lock, flags);
 
-    actual_len = 0;
-    res = usb_recv_cmd(dev, cmd->rx_data, cmd->rx_len, &actual_len);
-    if (res)
-        goto end;
+        if (!timedout && slot->status == SUCCESS)
+            return SUCCESS;
+
+        if (timedout)
+        {
+            this_cpu_inc(dev->xstats->cmd_timeouts);
+            printk("%s: RX Timeout, seq %u", DeviceName, slot->seq);
+        }
+        else
+            this_cpu_inc(dev->xstats->cmd_errors);
+
+        if (attempt >= cmd_retries)
+            return USB_COMMUNICATION_ERROR;
+
+        usb_kill_urb(slot->urb);
+        usb_cmd_send(slot);
+    }
+}
+
+void usb_cmd_release(struct usb_cmd_slot *slot)
+{
+    struct rexgen_usb *dev = slot->dev;
+    unsigned long flags;
+
+    // the response may overtake the completion of the command URB
+    usb_kill_urb(slot->urb);
+
+    spin_lock_irqsave(&dev->cmd_lock, flags);
+    slot->pending = false;
+    slot->busy = false;
+    spin_unlock_irqrestore(&dev->cmd_lock, flags);
+
+    wake_up(&dev->cmd_wq);
+}
+
+// synchronous command, the response is copied zero padded to rx if given
+static int send_cmd_usb(struct rexgen_usb *dev, const cmd_struct *cmdstruct,
+        const unsigned char *args, unsigned int nargs, unsigned char *rx, unsigned int rxsize)
+{
+    struct usb_cmd_slot *slot;
+    int res;
+
+    if (rx)
+        memset(rx, 0, rxsize);
+
+    slot = usb_cmd_submit(dev, cmdstruct, args, nargs);
+    if (!slot)
+        return USB_COMMUNICATION_ERROR;
+
+    res = usb_cmd_wait(slot);
+    if (!res && rx)
+        memcpy(rx, slot->rx_data, MIN(slot->rx_len, rxsize));
 
-    printkrx(cmd);
-    memcpy(&dev->usb_rx_data, &cmd->rx_data, cmd->rx_len);
-    dev->usb_rx_len = cmd->rx_len;
-end:
-    kfree(cmd);
+    usb_cmd_release(slot);
     return res;
 }
 
+int usb_cmd_init(struct rexgen_usb *dev)
+{
+    int i, err;
+
+    spin_lock_init(&dev->cmd_lock);
+    init_waitqueue_head(&dev->cmd_wq);
+    INIT_WORK(&dev->cmd_halt_work, cmd_halt_work);
+
+    for (i = 0; i < USB_CMD_SLOTS; i++)
+    {
+        struct usb_cmd_slot *slot = &dev->cmd_slots[i];
+
+        slot->dev = dev;
+        init_completion(&slot->done);
+
+        slot->urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!slot->urb)
+            goto nomem;
+
+        // only tx_data is used for DMA, responses are copied from the RX URB
+        slot->tx_data = kmalloc(2 * USB_CMD_BUFFER_SIZE, GFP_KERNEL);
+        if (!slot->tx_data)
+            goto nomem;
+        slot->rx_data = slot->tx_data + USB_CMD_BUFFER_SIZE;
+    }
+
+    dev->cmd_rx_urb = usb_alloc_urb(0, GFP_KERNEL);
+    dev->cmd_rx_buf = kmalloc(USB_CMD_RX_BUFFER_SIZE, GFP_KERNEL);
+    if (!dev->cmd_rx_urb || !dev->cmd_rx_buf)
+        goto nomem;
+
+    usb_fill_bulk_urb(dev->cmd_rx_urb, dev->udev,
+            usb_rcvbulkpipe(dev->udev, dev->bulk_in->bEndpointAddress),
+            dev->cmd_rx_buf, USB_CMD_RX_BUFFER_SIZE, read_cmd_callback, dev);
+
+    err = usb_submit_urb(dev->cmd_rx_urb, GFP_KERNEL);
+    if (err)
+    {
+        usb_cmd_cleanup(dev);
+        return err;
+    }
+
+    return SUCCESS;
+
+nomem:
+    usb_cmd_cleanup(dev);
+    return -ENOMEM;
+}
+
+void usb_cmd_cleanup(struct rexgen_usb *dev)
+{
+    int i;
+
+    // no resubmission from the callback or the halt work after this
+    usb_poison_urb(dev->cmd_rx_urb);
+    cancel_work_sync(&dev->cmd_halt_work);
+    usb_free_urb(dev->cmd_rx_urb);
+    kfree(dev->cmd_rx_buf);
+    dev->cmd_rx_urb = NULL;
+    dev->cmd_rx_buf = NULL;
+
+    for (i = 0; i < USB_CMD_SLOTS; i++)
+    {
+        struct usb_cmd_slot *slot = &dev->cmd_slots[i];
+
+        usb_kill_urb(slot->urb);
+        usb_free_urb(slot->urb);
+        kfree(slot->tx_data);
+        slot->urb = NULL;
+        slot->tx_data = NULL;
+        slot->rx_data = NULL;
+    }
+}
+
 int usb_get_firmware(struct rexgen_usb *dev)
 {
+    unsigned char rx[USB_CMD_BUFFER_SIZE];
     int res;
     
-    res = send_cmd_usb(dev, &cmdGetFwVersion);
+    res = send_cmd_usb(dev, &cmdGetFwVersion, NULL, 0, rx, sizeof(rx));
     if (!res)
     {
-        dev->fw_ver[0] = (dev->usb_rx_data[6] << 8) + dev->usb_rx_data[5];
-        dev->fw_ver[1] = dev->usb_rx_data[7];
-        dev->fw_ver[2] = dev->usb_rx_data[8];
-        dev->fw_ver[3] = dev->usb_rx_data[9];
+        dev->fw_ver[0] = (rx[6] << 8) + rx[5];
+        dev->fw_ver[1] = rx[7];
+        dev->fw_ver[2] = rx[8];
+        dev->fw_ver[3] = rx[9];
 
         // checking firmware version, supports the socket CAN
         if (dev->fw_ver[0] < SUPP_GET_NUM_CHANNELS_MAJOR)
@@ -141,166 +417,307 @@ int usb_get_firmware(struct rexgen_usb *dev)
 
 int usb_get_num_channels(struct rexgen_usb *dev)
 {
+    unsigned char rx[USB_CMD_BUFFER_SIZE];
     int res;
     dev->nchannels = CAN_CHANNELS; 
     
-    res = send_cmd_usb(dev, &cmdCANBusCount);
+    res = send_cmd_usb(dev, &cmdCANBusCount, NULL, 0, rx, sizeof(rx));
     if (!res)
-        dev->nchannels = dev->usb_rx_data[5];
+        dev->nchannels = rx[5];
 
     return res;
 }
 
 int usb_start_live_data(struct rexgen_usb *dev)
 {
-    return send_cmd_usb(dev, &cmmdUSBStartLiveData);
+    return send_cmd_usb(dev, &cmmdUSBStartLiveData, NULL, 0, NULL, 0);
 }
 
 int usb_stop_live_data(struct rexgen_usb *dev)
 {
-    return send_cmd_usb(dev, &cmmdUSBStopLiveData);
+    return send_cmd_usb(dev, &cmmdUSBStopLiveData, NULL, 0, NULL, 0);
+}
+
+// the device answers a command it could not carry out with 0xff in bytes 6-8
+static bool usb_cmd_failed(const struct usb_cmd_slot *slot)
+{
+    const unsigned char *rx = slot->rx_data;
+
+    return slot->rx_len < 9 || (rx[6] == 255 && rx[7] == 255 && rx[8] == 255);
+}
+
+static int store_block_uid(struct rexgen_usb *dev, const struct usb_cmd_slot *slot, int channel, int type)
+{
+    const unsigned char *rx = slot->rx_data;
+
+    // returned errors
+    if (usb_cmd_failed(slot) ||
+        (rx[5] == 0 && rx[6] == 0 && rx[7] == 0 && rx[8] == 0))
+    {
+        printk("%s: Error reading block UID for channel %i and type %i", DeviceName, channel, type);
+        return USB_COMMUNICATION_ERROR;
+    }
+
+    dev->nets[channel]->usb_block_uid[type] = (rx[6] << 8) + rx[5];
+    return SUCCESS;
+}
+
+static const rexgen_rec_handler rec_handlers[3] = {
+    [IDX_CAN_BLOCK_UID_RX] = can2socket,
+    [IDX_CAN_BLOCK_UID_TX] = can2socket,
+    [IDX_CAN_BLOCK_UID_ERR] = err2socket,
+};
+
+bool err_records_supported(struct rexgen_usb *dev)
+{
+    unsigned int major, minor, patch;
+
+    if (sscanf(err_records_fw, "%u.%u.%u", &major, &minor, &patch) != 3)
+        return false;
+
+    if (dev->fw_ver[0] != major)
+        return dev->fw_ver[0] > major;
+    if (dev->fw_ver[1] != minor)
+        return dev->fw_ver[1] > minor;
+    return dev->fw_ver[2] >= patch;
+}
+
+// Maps every block UID read from the device to its channel and record handler,
+// records of the ERR blocks are left unknown when they are not decoded
+static int build_uid_table(struct rexgen_usb *dev)
+{
+    struct rexgen_uid_entry *table, *entry;
+    unsigned int bits, mask, i, kind, kinds, pos;
+    u16 uid;
+
+    kinds = ARRAY_SIZE(rec_handlers);
+    if (!err_records_supported(dev))
+    {
+        dev_info(&dev->intf->dev, "ERR records are not decoded on this firmware, see err_records_fw\n");
+        kinds = IDX_CAN_BLOCK_UID_ERR; // the last kind
+    }
+
+    bits = max_t(unsigned int, order_base_2(dev->nchannels * 3) + 1, 4);
+    table = devm_kcalloc(&dev->intf->dev, 1U << bits, sizeof(*table), GFP_KERNEL);
+    if (!table)
+        return -ENOMEM;
+    mask = (1U << bits) - 1;
+
+    for (i = 0; i < dev->nchannels; i++)
+    {
+        for (kind = 0; kind < kinds; kind++)
+        {
+            uid = dev->nets[i]->usb_block_uid[kind];
+            for (pos = hash_32(uid, bits); table[pos].used; pos = (pos + 1) & mask)
+                if (table[pos].uid == uid)
+                    break;
+
+            entry = &table[pos];
+            if (entry->used)
+            {
+                dev_warn(&dev->intf->dev, "Block UID %u of channel %u is already used by channel %d\n",
+                        uid, i, entry->net->channel);
+                continue;
+            }
+
+            entry->uid = uid;
+            entry->kind = kind;
+            entry->net = dev->nets[i];
+            entry->handler = rec_handlers[kind];
+            entry->used = true;
+        }
+    }
+
+    // the live data is only started afterwards
+    dev->uid_bits = bits;
+    dev->uid_table = table;
+    return SUCCESS;
 }
 
 int usb_can_intf_enable(struct rexgen_usb *dev)
 {
-    int res, i, j;
+    struct usb_cmd_slot *slots[USB_CMD_SLOTS];
+    int res, err, total, first, count, k;
 
-    res = send_cmd_usb(dev, &cmdCANIntfEnable);
+    res = send_cmd_usb(dev, &cmdCANIntfEnable, NULL, 0, NULL, 0);
     if (res)
     	return res;
 
-    // load channels UID
-    for (i = 0; i < dev->nchannels; i++)
+    // load channels UID, the queries are independent so up to USB_CMD_SLOTS
+    // of them are kept in flight
+    total = dev->nchannels * 3;
+    for (first = 0; first < total; first += count)
     {
-	   for (j = 0; j < 3; j++)
-	   {
-            cmdCANBlockUIDGet.cmd_data[2] = i;
-            cmdCANBlockUIDGet.cmd_data[3] = i >> 8;
-            cmdCANBlockUIDGet.cmd_data[4] = j;
+        count = MIN(total - first, USB_CMD_SLOTS);
 
-            res = send_cmd_usb(dev, &cmdCANBlockUIDGet);
-            if (res)
+        for (k = 0; k < count; k++)
+        {
+            int i = (first + k) / 3;
+            unsigned char args[3] = { i, i >> 8, (first + k) % 3 };
+
+            slots[k] = usb_cmd_submit(dev, &cmdCANBlockUIDGet, args, sizeof(args));
+        }
+
+        for (k = 0; k < count; k++)
+        {
+            if (!slots[k])
             {
-                printk("%s: Cannot read CAN block UID", DeviceName);
-                return res;
+                res = USB_COMMUNICATION_ERROR;
+                continue;
             }
 
-            // returned errors
-            if ((dev->usb_rx_data[5] == 0 && dev->usb_rx_data[6] == 0 && 
-                dev->usb_rx_data[7] == 0 && dev->usb_rx_data[8] == 0) ||
-                (dev->usb_rx_data[6] == 255 && dev->usb_rx_data[7] == 255 && dev->usb_rx_data[8] == 255))
-            {
-                printk("%s: Error reading block UID for channel %i and type %i", DeviceName, i, j);
-                return USB_COMMUNICATION_ERROR;
-    	    }
+            err = usb_cmd_wait(slots[k]);
+            if (!err && !res)
+                err = store_block_uid(dev, slots[k], (first + k) / 3, (first + k) % 3);
+            else if (err)
+                printk("%s: Cannot read CAN block UID", DeviceName);
+            if (err && !res)
+                res = err;
 
-    	    dev->nets[i]->usb_block_uid[j] = (dev->usb_rx_data[6] << 8) + dev->usb_rx_data[5];
+            usb_cmd_release(slots[k]);
         }
+
+        if (res)
+            return res;
     }
 
-    return res;
+    return build_uid_table(dev);
 }
 
 int usb_can_intf_disable(struct rexgen_usb *dev)
 {
-    return send_cmd_usb(dev, &cmdCANIntfDisable);
+    return send_cmd_usb(dev, &cmdCANIntfDisable, NULL, 0, NULL, 0);
 }
 
+// can-dev has already stored the new timing in net->can, it is sent to the
+// device by usb_can_bus_start() at the next open
 int usb_set_bittiming(struct net_device *netdev)
 {
     struct rexgen_net *net = netdev_priv(netdev);
     struct can_bittiming *bt = &net->can.bittiming;
-    struct rexgen_usb *dev = net->dev;
 
-    if (USB_CMD_DEBUG)
-    {
-        printk("%s: CAN bittiming", DeviceName);
-        printk("%s:      bitrate - %i", DeviceName, bt->bitrate);
-        printk("%s: sample_point - %i", DeviceName, bt->sample_point);
-        printk("%s:           tq - %i", DeviceName, bt->tq);
-        printk("%s:     prop_seg - %i", DeviceName, bt->prop_seg);
-        printk("%s:   phase_seg1 - %i", DeviceName, bt->phase_seg1);
-        printk("%s:   phase_seg2 - %i", DeviceName, bt->phase_seg2);
-        printk("%s:          sjw - %i", DeviceName, bt->sjw);
-        printk("%s:          brp - %i", DeviceName, bt->brp);
-    }
-
-    cmdCANParamSet.cmd_data[2] = net->channel; 
-    cmdCANParamSet.cmd_data[3] = net->channel >> 8;
-    cmdCANParamSet.cmd_data[4] = bt->bitrate; 
-    cmdCANParamSet.cmd_data[5] = bt->bitrate >> 8; 
-    cmdCANParamSet.cmd_data[6] = bt->bitrate >> 16;
-    cmdCANParamSet.cmd_data[7] = bt->bitrate >> 24;
-    cmdCANParamSet.cmd_data[8] = bt->prop_seg + bt->phase_seg1;   
-    cmdCANParamSet.cmd_data[9] = bt->phase_seg2;
-    cmdCANParamSet.cmd_data[10] = bt->sjw;      
-    cmdCANParamSet.cmd_data[11] = bt->brp; 
-  
-    return send_cmd_usb(dev, &cmdCANParamSet);
+    netdev_dbg(netdev, "CAN bittiming: bitrate %u sample_point %u tq %u prop_seg %u phase_seg1 %u phase_seg2 %u sjw %u brp %u\n",
+            bt->bitrate, bt->sample_point, bt->tq, bt->prop_seg,
+            bt->phase_seg1, bt->phase_seg2, bt->sjw, bt->brp);
+
+    return 0;
 }
 
 int usb_set_data_bittiming(struct net_device *netdev)
 {
     struct rexgen_net *net = netdev_priv(netdev);
     struct can_bittiming *bt = &net->can.data_bittiming;
-    struct rexgen_usb *dev = net->dev;
 
-    if (USB_CMD_DEBUG)
-    {
-        printk("%s: CANFD bittiming", DeviceName);
-        printk("%s:      bitrate - %i", DeviceName, bt->bitrate);
-        printk("%s: sample_point - %i", DeviceName, bt->sample_point);
-        printk("%s:           tq - %i", DeviceName, bt->tq);
-        printk("%s:     prop_seg - %i", DeviceName, bt->prop_seg);
-        printk("%s:   phase_seg1 - %i", DeviceName, bt->phase_seg1);
-        printk("%s:   phase_seg2 - %i", DeviceName, bt->phase_seg2);
-        printk("%s:          sjw - %i", DeviceName, bt->sjw);
-        printk("%s:          brp - %i", DeviceName, bt->brp);
-    }
+    netdev_dbg(netdev, "CANFD bittiming: bitrate %u sample_point %u tq %u prop_seg %u phase_seg1 %u phase_seg2 %u sjw %u brp %u\n",
+            bt->bitrate, bt->sample_point, bt->tq, bt->prop_seg,
+            bt->phase_seg1, bt->phase_seg2, bt->sjw, bt->brp);
 
-    cmdCANDataParamSet.cmd_data[2] = net->channel; 
-    cmdCANDataParamSet.cmd_data[3] = net->channel >> 8;
-    cmdCANDataParamSet.cmd_data[4] = bt->bitrate; 
-    cmdCANDataParamSet.cmd_data[5] = bt->bitrate >> 8; 
-    cmdCANDataParamSet.cmd_data[6] = bt->bitrate >> 16;
-    cmdCANDataParamSet.cmd_data[7] = bt->bitrate >> 24;
-    cmdCANDataParamSet.cmd_data[8] = bt->prop_seg + bt->phase_seg1;   
-    cmdCANDataParamSet.cmd_data[9] = bt->phase_seg2;
-    cmdCANDataParamSet.cmd_data[10] = bt->sjw;      
-    cmdCANDataParamSet.cmd_data[11] = bt->brp; 
-  
-    return send_cmd_usb(dev, &cmdCANDataParamSet);
+    return 0;
 }
 
-int usb_can_bus_open(struct rexgen_usb *dev, unsigned short channel, unsigned char flags)
+static void bittiming_args(unsigned char *args, const struct rexgen_net *net,
+        const struct can_bittiming *bt)
 {
+    bittiming2args(args, net->channel, bt->bitrate, bt->prop_seg + bt->phase_seg1,
+                   bt->phase_seg2, bt->sjw, bt->brp);
+}
+
+// sends a command and checks its status, see usb_cmd_failed()
+static int send_cmd_checked(struct rexgen_usb *dev, const cmd_struct *cmdstruct,
+        const unsigned char *args, unsigned int nargs)
+{
+    struct usb_cmd_slot *slot;
     int res;
 
-    cmdCANBusOpen.cmd_data[2] = channel;
-    cmdCANBusOpen.cmd_data[3] = channel >> 8;
-    cmdCANBusOpen.cmd_data[4] = flags;
-    
-    res = send_cmd_usb(dev, &cmdCANBusOpen);
-    if (res)
+    slot = usb_cmd_submit(dev, cmdstruct, args, nargs);
+    if (!slot)
+        return USB_COMMUNICATION_ERROR;
+
+    res = usb_cmd_wait(slot);
+    if (!res && usb_cmd_failed(slot))
+        res = USB_COMMUNICATION_ERROR;
+
+    usb_cmd_release(slot);
+    return res;
+}
+
+// Brings a channel up: bus open with the mode flags, the bit timings when they
+// differ from what the device was last given, bus on. Only the two timings are
+// in flight together, they do not depend on each other; usb_cmd_wait() resends
+// a command whose response was lost, so the open has to be answered before the
+// timings go out and both timings before bus on, or a resent command could
+// overtake the one that follows it.
+int usb_can_bus_start(struct rexgen_net *net, unsigned char flags)
+{
+    struct rexgen_usb *dev = net->dev;
+    unsigned short channel = net->channel;
+    unsigned char open_args[3] = { channel, channel >> 8, flags };
+    unsigned char on_args[2] = { channel, channel >> 8 };
+    unsigned char bt_args[RexBittimingArgsLength], dbt_args[RexBittimingArgsLength];
+    struct usb_cmd_slot *slots[2];
+    bool set_bt, set_dbt = false;
+    int count = 0, res, err, i;
+
+    bittiming_args(bt_args, net, &net->can.bittiming);
+    set_bt = !net->bt_valid || memcmp(bt_args, net->bt_args, sizeof(bt_args));
+    if (net->can.ctrlmode & CAN_CTRLMODE_FD)
     {
-       printk("%s: Can not open channel %i", DeviceName, channel);
-       return res;
+        bittiming_args(dbt_args, net, &net->can.data_bittiming);
+        set_dbt = !net->dbt_valid || memcmp(dbt_args, net->dbt_args, sizeof(dbt_args));
     }
-    else
+
+    res = send_cmd_checked(dev, &cmdCANBusOpen, open_args, sizeof(open_args));
+
+    if (!res && set_bt)
+        slots[count++] = usb_cmd_submit(dev, &cmdCANParamSet, bt_args, sizeof(bt_args));
+    if (!res && set_dbt)
+        slots[count++] = usb_cmd_submit(dev, &cmdCANDataParamSet, dbt_args, sizeof(dbt_args));
+
+    for (i = 0; i < count; i++)
     {
-        printk("%s: Channel %i is opened", DeviceName, channel);
-        return SUCCESS;
+        if (!slots[i])
+        {
+            res = USB_COMMUNICATION_ERROR;
+            continue;
+        }
+
+        err = usb_cmd_wait(slots[i]);
+        if (!err && usb_cmd_failed(slots[i]))
+            err = USB_COMMUNICATION_ERROR;
+        if (err && !res)
+            res = err;
+
+        usb_cmd_release(slots[i]);
+    }
+
+    if (!res)
+        res = send_cmd_checked(dev, &cmdCANBusOn, on_args, sizeof(on_args));
+
+    // on any failure the device state is unknown, send the timings again next time
+    net->bt_valid = !res;
+    net->dbt_valid = !res && (net->dbt_valid || set_dbt);
+    if (res)
+    {
+        printk("%s: Can not start channel %i", DeviceName, channel);
+        return res;
     }
+
+    if (set_bt)
+        memcpy(net->bt_args, bt_args, sizeof(bt_args));
+    if (set_dbt)
+        memcpy(net->dbt_args, dbt_args, sizeof(dbt_args));
+
+    printk("%s: Channel %i is turned on%s", DeviceName, channel,
+           set_bt || set_dbt ? "" : ", bit timing unchanged");
+    return SUCCESS;
 }
 
 int usb_can_bus_close(struct rexgen_usb *dev, unsigned short channel)
 {
+    unsigned char args[2] = { channel, channel >> 8 };
     int res;
 
-    cmdCANBusClose.cmd_data[2] = channel;
-    cmdCANBusClose.cmd_data[3] = channel >> 8;
-    
-    res = send_cmd_usb(dev, &cmdCANBusClose);
+    res = send_cmd_usb(dev, &cmdCANBusClose, args, sizeof(args), NULL, 0);
     if (res)
     {
        printk("%s: Can not close channel %i", DeviceName, channel);
@@ -315,13 +732,10 @@ int usb_can_bus_close(struct rexgen_usb *dev, unsigned short channel)
 
 int usb_can_bus_on(struct rexgen_usb *dev, unsigned short channel)
 {
+    unsigned char args[2] = { channel, channel >> 8 };
     int res;
 
-    memcpy(&(cmdCANBusOn.cmd_data[2]), &channel, 2);
-    cmdCANBusOn.cmd_data[2] = channel;
-    cmdCANBusOn.cmd_data[3] = channel >> 8;
-
-    res = send_cmd_usb(dev, &cmdCANBusOn);
+    res = send_cmd_usb(dev, &cmdCANBusOn, args, sizeof(args), NULL, 0);
     if (res)
     {       
        printk("%s: Can not start channel %i", DeviceName, channel);
@@ -336,13 +750,10 @@ int usb_can_bus_on(struct rexgen_usb *dev, unsigned short channel)
 
 int usb_can_bus_off(struct rexgen_usb *dev, unsigned short channel)
 {
+    unsigned char args[2] = { channel, channel >> 8 };
     int res;
 
-    memcpy(&(cmdCANBusOff.cmd_data[2]), &channel, 2);
-    cmdCANBusOff.cmd_data[2] = channel;
-    cmdCANBusOff.cmd_data[3] = channel >> 8;
-
-    res = send_cmd_usb(dev, &cmdCANBusOff);
+    res = send_cmd_usb(dev, &cmdCANBusOff, args, sizeof(args), NULL, 0);
     if (res)
     {       
        printk("%s: Can not stop channel %i", DeviceName, channel);
@@ -355,63 +766,187 @@ int usb_can_bus_off(struct rexgen_usb *dev, unsigned short channel)
     }
 }
 
-void can2socket(struct rexgen_usb *dev, usb_record *rec)
+static u64 usb_timestamp_read(const struct cyclecounter *cc)
+{
+    const struct rexgen_usb *dev = container_of(cc, struct rexgen_usb, cc);
+
+    return dev->ts_last;
+}
+
+// a quarter of the 32 bit counter wrap, about 18 min at 1 MHz
+static unsigned long usb_timestamp_interval(void)
+{
+    return msecs_to_jiffies(div_u64(1ULL << 30, rex_usb_cfg.timestamp_freq * 1000));
+}
+
+// The base has to move on within half a counter wrap, or the next timestamp
+// is taken as an older one. On a silent bus the device counter is estimated
+// from the host clock since the last record; an error of the estimate only
+// shifts the base, the following records are still converted exactly.
+static void usb_timestamp_work(struct work_struct *work)
+{
+    struct rexgen_usb *dev = container_of(to_delayed_work(work), struct rexgen_usb, ts_work);
+    unsigned long now = jiffies;
+
+    spin_lock_bh(&dev->ts_lock);
+    dev->ts_last += jiffies_to_usecs(now - dev->ts_last_jiffies) * rex_usb_cfg.timestamp_freq;
+    dev->ts_last_jiffies = now;
+    timecounter_read(&dev->tc);
+    spin_unlock_bh(&dev->ts_lock);
+
+    schedule_delayed_work(&dev->ts_work, usb_timestamp_interval());
+}
+
+void usb_init_timestamp(struct rexgen_usb *dev)
+{
+    dev->cc.read = usb_timestamp_read;
+    dev->cc.mask = CYCLECOUNTER_MASK(32);
+    dev->cc.shift = 10;
+    dev->cc.mult = clocksource_khz2mult(rex_usb_cfg.timestamp_freq * 1000, dev->cc.shift);
+    dev->tcinitdone = false;
+    spin_lock_init(&dev->ts_lock);
+    INIT_DELAYED_WORK(&dev->ts_work, usb_timestamp_work);
+}
+
+// called once the NAPI poll is stopped
+void usb_stop_timestamp(struct rexgen_usb *dev)
+{
+    cancel_delayed_work_sync(&dev->ts_work);
+}
+
+u64 usb_timestamp_to_ns(struct rexgen_usb *dev, u32 timestamp)
+{
+    u64 ns;
+
+    spin_lock(&dev->ts_lock);
+
+    // the device counter is anchored to the host clock at the first record
+    if (!dev->tcinitdone)
+    {
+        dev->ts_last = timestamp;
+        dev->ts_last_jiffies = jiffies;
+        timecounter_init(&dev->tc, &dev->cc, ktime_get_real_ns());
+        dev->tcinitdone = true;
+        ns = dev->tc.nsec;
+        spin_unlock(&dev->ts_lock);
+
+        schedule_delayed_work(&dev->ts_work, usb_timestamp_interval());
+        return ns;
+    }
+
+    // records may arrive slightly out of order between channels, so only a newer
+    // timestamp moves the wraparound base forward
+    ns = timecounter_cyc2time(&dev->tc, timestamp);
+    if (ns > dev->tc.nsec)
+    {
+        dev->ts_last = timestamp;
+        dev->ts_last_jiffies = jiffies;
+        timecounter_read(&dev->tc);
+    }
+
+    spin_unlock(&dev->ts_lock);
+    return ns;
+}
+
+static bool rx_filter_accept(struct rexgen_net *net, canid_t canid)
+{
+    const struct rexgen_filter *filter;
+    unsigned int lo, hi, mid;
+    bool accept = true;
+    u32 id;
+
+    rcu_read_lock();
+    filter = rcu_dereference(net->filter);
+    if (filter)
+    {
+        if (!(canid & CAN_EFF_FLAG))
+            accept = test_bit(canid & CAN_SFF_MASK, filter->sff);
+        else
+        {
+            id = canid & CAN_EFF_MASK;
+            accept = false;
+            lo = 0;
+            hi = filter->neff;
+            while (lo < hi)
+            {
+                mid = (lo + hi) / 2;
+                if (id < filter->eff[mid].from)
+                    hi = mid;
+                else if (id > filter->eff[mid].to)
+                    lo = mid + 1;
+                else
+                {
+                    accept = true;
+                    break;
+                }
+            }
+        }
+    }
+    rcu_read_unlock();
+
+    return accept;
+}
+
+void can2socket(struct rexgen_usb *dev, struct rexgen_net *net, usb_record *rec)
 {
-    unsigned long irqflags;
-    int channel;
     unsigned int timestamp;
     unsigned int canid;
     unsigned char canflags;
 
-    struct rexgen_net *net;
     struct can_frame *cf;
     struct canfd_frame *cfdf;
     struct sk_buff *skb;
-    struct net_device_stats *stats;
     void *dataptr;
+    u64 ns;
     unsigned char *canlen;
 
-    channel = rec->uid - 100;
-    timestamp = *(unsigned int*)(rec->inf);
-    canid = *(unsigned int*)(rec->inf + 4);
-    canflags = *(unsigned char*)(rec->inf + 8);
+    this_cpu_inc(net->stats->rx_records);
 
-    net = dev->nets[channel];
-    stats = &net->netdev->stats;
-    struct can_priv *priv = netdev_priv(net->netdev);
+    if (rec->infsize < RexRecordCanInfLength)
+    {
+        rexgen_rx_stats(net, 0, 0, 0, 1, 0);
+        return;
+    }
 
-    if (canflags & DataFrame_DIR)
+    timestamp = get_unaligned_le32(rec->inf);
+    canid = get_unaligned_le32(rec->inf + 4);
+    canflags = rec->inf[8];
+
+    if (rec->dlc > ((canflags & DataFrame_EDL) ? CANFD_MAX_DLEN : CAN_MAX_DLEN))
     {
-        skb = net->echoskb;//priv->echo_skb[0];
-        if (!skb)
-            return;
-        spin_lock_irqsave(&net->tx_contexts_lock, irqflags);
-        if (canflags & DataFrame_EDL)
-            cfdf = (struct canfd_frame*)skb->data;
-        else
-            cf = (struct can_frame*)skb->data;
+        rexgen_rx_stats(net, 0, 0, 0, 1, 0);
+        return;
     }
-    else
+
+    if (canflags & DataFrame_IDE)
+        canid |= CAN_EFF_FLAG;
+
+    // confirmation of a frame we sent
+    if (canflags & DataFrame_DIR)
     {
-        if (canflags & DataFrame_EDL)
-            skb = alloc_canfd_skb(net->netdev, &cfdf);
-        else
-            skb = alloc_can_skb(net->netdev, &cf);
+        tx_confirm(net, canid, usb_timestamp_to_ns(dev, timestamp));
+        return;
     }
 
-    if (!(canflags & DataFrame_DIR))
+    if (!rx_filter_accept(net, canid))
     {
-        if (!skb) {
-            stats->rx_dropped++;
-            return;
-        }
+        net->rx_filtered++;
+        return;
     }
 
-    if (canflags & DataFrame_IDE)
-        canid |= CAN_EFF_FLAG;
     if (canflags & DataFrame_SRR)
         canid |= CAN_RTR_FLAG;
 
+    if (canflags & DataFrame_EDL)
+        skb = alloc_canfd_skb(net->netdev, &cfdf);
+    else
+        skb = alloc_can_skb(net->netdev, &cf);
+
+    if (!skb) {
+        rexgen_rx_stats(net, 0, 0, 1, 0, 0);
+        return;
+    }
+
     if (canflags & DataFrame_EDL)
     {
         cfdf->can_id = canid;
@@ -432,61 +967,151 @@ void can2socket(struct rexgen_usb *dev, usb_record *rec)
     }
 
     *canlen = rec->dlc;
-    memcpy(dataptr, &(rec->data[0]), rec->dlc);
+    memcpy(dataptr, rec->data, rec->dlc);
+    ns = usb_timestamp_to_ns(dev, timestamp);
+    skb_hwtstamps(skb)->hwtstamp = ns_to_ktime(ns);
 
-    if (canflags & DataFrame_DIR)
+    // the device clock is anchored to the host clock by the first record, so
+    // REXGEN_HIST_RX_USB shows the variation rather than the absolute USB delay
+    if (rexgen_latency_hist && dev->rx_urb_ns)
     {
+        rexgen_hist_add(net, REXGEN_HIST_RX_USB, dev->rx_urb_real_ns - ns);
+        rexgen_hist_add(net, REXGEN_HIST_RX_STACK, ktime_get_ns() - dev->rx_urb_ns);
+    }
 
-        //struct can_skb_priv *can_skb_priv = can_skb_prv(skb);
-        //struct skb_shared_info *shinfo = skb_shinfo(skb);
-        //struct skb_shared_info *shinfo = skb_shinfo(skb);
-        //skb_shinfo(skb)->flags = skb_shinfo(net->echoskb)->flags;
-        //skb_shinfo(skb)->tx_flags = skb_shinfo(net->echoskb)->tx_flags;
+    // called from the NAPI poll, so frames go straight into the stack; a
+    // remote request carries no data
+    if (netif_receive_skb(skb) == NET_RX_DROP)
+        rexgen_rx_stats(net, 0, 0, 1, 0, 0);
+    else
+        rexgen_rx_stats(net, 1, (canid & CAN_RTR_FLAG) ? 0 : rec->dlc, 0, 0, 0);
+}
 
-        //skb_tstamp_tx(skb, skb_hwtstamps(skb));
-        //skb->tail = net->echoskb->tail;
+static bool err_frame_allowed(struct rexgen_net *net)
+{
+    if (time_after(jiffies, net->err_window + HZ))
+    {
+        net->err_window = jiffies;
+        net->err_count = 0;
+    }
 
+    return net->err_count++ < USB_MAX_ERR_FRAMES;
+}
 
-        //skb->pkt_type = PACKET_BROADCAST;
+// Decodes a record of the ERR block: updates the error counters and the bus
+// state and reports bus errors as CAN error frames
+void err2socket(struct rexgen_usb *dev, struct rexgen_net *net, usb_record *rec)
+{
+    enum can_state state, tx_state, rx_state;
+    struct can_frame *cf = NULL;
+    struct sk_buff *skb = NULL;
+    unsigned int timestamp;
+    unsigned char status, code;
+    bool bus_error, state_changed;
 
-        skb_get(skb);
-        if (netif_rx(skb) == NET_RX_SUCCESS)
-            dev_consume_skb_any(skb);
-        else
-            dev_kfree_skb_any(skb);
-        net->echoskb = NULL;
-        spin_unlock_irqrestore(&net->tx_contexts_lock, irqflags);
+    if (!netif_running(net->netdev))
+        return;
 
-        //netif_rx(skb);
-        //can_get_echo_skb(net->netdev, 0);
-        //spin_lock_irqsave(&net->tx_contexts_lock, irqflags);
-        //can_free_echo_skb(net->netdev, 0);
-        //spin_unlock_irqrestore(&net->tx_contexts_lock, irqflags);
+    if (rec->infsize < RexRecordErrInfLength)
+    {
+        rexgen_rx_stats(net, 0, 0, 0, 1, 0);
+        return;
     }
+
+    timestamp = get_unaligned_le32(rec->inf);
+    status = rec->inf[4];
+    code = rec->inf[5];
+    net->bec.txerr = rec->inf[6];
+    net->bec.rxerr = rec->inf[7];
+
+    if (status & ErrFrame_BUSOFF)
+        state = CAN_STATE_BUS_OFF;
+    else if (status & ErrFrame_PASSIVE)
+        state = CAN_STATE_ERROR_PASSIVE;
+    else if (status & ErrFrame_WARNING)
+        state = CAN_STATE_ERROR_WARNING;
     else
+        state = CAN_STATE_ERROR_ACTIVE;
+
+    bus_error = code >= ErrCode_STUFF && code <= ErrCode_CRC;
+    if (bus_error)
+        net->can.can_stats.bus_error++;
+
+    if (bus_error || (status & ErrFrame_RX_OVERFLOW))
+        rexgen_rx_stats(net, 0, 0, 0, bus_error + !!(status & ErrFrame_RX_OVERFLOW),
+                !!(status & ErrFrame_RX_OVERFLOW));
+
+    // state changes are always reported, a babbling bus is rate limited
+    state_changed = state != net->can.state;
+    if (!state_changed)
     {
-        stats->rx_bytes += rec->dlc;
-        stats->rx_packets++;
+        if (!(status & ErrFrame_RX_OVERFLOW) &&
+            !(bus_error && (net->can.ctrlmode & CAN_CTRLMODE_BERR_REPORTING)))
+            return;
 
-        netif_rx(skb);
+        if (!err_frame_allowed(net))
+            return;
     }
-}
 
-unsigned short livedata_size(void *buff, int len)
-{
-    if (len < 2)
-        return 0;
+    skb = alloc_can_err_skb(net->netdev, &cf);
 
-    return *(unsigned short*)buff + 2;
-}
+    if (state_changed)
+    {
+        tx_state = net->bec.txerr >= net->bec.rxerr ? state : CAN_STATE_ERROR_ACTIVE;
+        rx_state = net->bec.txerr <= net->bec.rxerr ? state : CAN_STATE_ERROR_ACTIVE;
+        can_change_state(net->netdev, cf, tx_state, rx_state);
 
-int ptr2rec(usb_record *rec, void *buff)
-{
-    rec->uid = *(unsigned short*)(buff);
-    rec->infsize = MIN(*(unsigned char*)(buff + 2), RexRecordMaxInfLength);
-    rec->dlc = MIN(*(unsigned char*)(buff + 3), RexRecordMaxCanLength);
-    memcpy(rec->inf, buff + 4, rec->infsize);
-    memcpy(rec->data, buff + 4 + rec->infsize, rec->dlc);
+        if (state == CAN_STATE_BUS_OFF)
+            can_bus_off(net->netdev);
+    }
+
+    if (!skb)
+    {
+        rexgen_rx_stats(net, 0, 0, 1, 0, 0);
+        return;
+    }
+
+    if (bus_error && (net->can.ctrlmode & CAN_CTRLMODE_BERR_REPORTING))
+    {
+        cf->can_id |= CAN_ERR_PROT | CAN_ERR_BUSERROR;
+        switch (code)
+        {
+            case ErrCode_STUFF:
+                cf->data[2] |= CAN_ERR_PROT_STUFF;
+                break;
+            case ErrCode_FORM:
+                cf->data[2] |= CAN_ERR_PROT_FORM;
+                break;
+            case ErrCode_ACK:
+                cf->can_id |= CAN_ERR_ACK;
+                cf->data[3] = CAN_ERR_PROT_LOC_ACK;
+                break;
+            case ErrCode_BIT1:
+                cf->data[2] |= CAN_ERR_PROT_BIT1;
+                break;
+            case ErrCode_BIT0:
+                cf->data[2] |= CAN_ERR_PROT_BIT0;
+                break;
+            case ErrCode_CRC:
+                cf->data[3] = CAN_ERR_PROT_LOC_CRC_SEQ;
+                break;
+        }
+    }
+
+    if (status & ErrFrame_RX_OVERFLOW)
+    {
+        cf->can_id |= CAN_ERR_CRTL;
+        cf->data[1] |= CAN_ERR_CRTL_RX_OVERFLOW;
+    }
+
+    if (state != CAN_STATE_BUS_OFF)
+    {
+        cf->can_id |= CAN_ERR_CNT;
+        cf->data[6] = net->bec.txerr;
+        cf->data[7] = net->bec.rxerr;
+    }
 
-    return 4 + rec->infsize + rec->dlc;
+    skb_hwtstamps(skb)->hwtstamp = ns_to_ktime(usb_timestamp_to_ns(dev, timestamp));
+    if (netif_receive_skb(skb) == NET_RX_DROP)
+        rexgen_rx_stats(net, 0, 0, 1, 0, 0);
 }
@@ -0,0 +1,925 @@
+// SPDX-License-Identifier: GPL-2.0
+/* 
+    USB to SocketCAN driver for ReXgen
+    Copyright (C) 1999-2021 Influx Technology LTD, UK. All rights reserved.
+    Contacts: https://www.influxtechnology.com/contact
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// ReXgen device model on raw-gadget (make emulator). Plays the device side of
+// README/usb-protocol.md on a UDC, normally dummy_hcd, so that rexgen_usb probes
+// and carries traffic without a ReXgen:
+//
+//     modprobe dummy_hcd; modprobe raw_gadget
+//     build/rexgen_emu [options] &
+//     ip link set can0 up type can bitrate 500000
+//
+// The channels are connected through a virtual bus:
+//   * a frame sent on a channel in loopback mode is confirmed with a DIR record
+//   * with --bridge it is received by every other channel that is on-bus
+//   * --rate adds generated frames on every channel that is on-bus, for RX load,
+//     --fd-mix spreads them over classic, FD and FD+BRS lengths
+//   * --err-rate adds bus errors as ERR block records, with error counters that
+//     walk the channel through warning and passive and back
+// --drop-resp drops every n-th command response to exercise the command retries.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+#include "../src/rexgen_proto.h"
+
+#define EMU_VENDOR_ID       0x16d0 // as DEVICE_VENDOR_ID / DEVICE_PRODUCT_ID in rexgen_def.h
+#define EMU_PRODUCT_ID      0x0f14
+#define EMU_MAX_CHANNELS    16
+#define EMU_MAX_PACKET      512
+#define EMU_CMD_SIZE        64 // USB_CMD_BUFFER_SIZE
+#define EMU_LIVE_OUT_SIZE   0x4000
+#define EMU_LIVE_IN_SIZE    EMU_MAX_PACKET // one block per transfer, fits any RX URB
+#define EMU_QUEUE_SIZE      (1 << 20)
+#define EMU_EP0_SIZE        256
+
+// command codes, USB_CMD_* in rexgen_def.h
+#define CMD_GET_FW_VERSION          0x02
+#define CMD_START_LIVE_DATA         0x19
+#define CMD_STOP_LIVE_DATA          0x1a
+#define CMD_CAN_INTERFACE_ENABLE    0x31
+#define CMD_CAN_INTERFACE_DISABLE   0x32
+#define CMD_CAN_BUS_COUNT           0x33
+#define CMD_CAN_BUS_OPEN            0x34
+#define CMD_CAN_BUS_CLOSE           0x35
+#define CMD_CAN_BUS_ON              0x36
+#define CMD_CAN_BUS_OFF             0x37
+#define CMD_CAN_PARAM_SET           0x38
+#define CMD_CAN_DATA_PARAM_SET      0x3a
+#define CMD_CAN_BLOCK_UID_GET       0x3c
+
+#define CAN_INTERFACE_LISTENONLY    1
+#define CAN_INTERFACE_FD_ISO        2
+#define CAN_INTERFACE_FD_NON_ISO    4
+#define CAN_INTERFACE_LOOPBACK      8
+
+// response payload lengths, the rx_len of the command templates in rexgen_def.h
+// less the frame overhead; a status payload of zeros is a success
+#define RESP_FW_VERSION     9
+#define RESP_BUS_COUNT      1
+#define RESP_LIVE_DATA      1
+#define RESP_STATUS         4
+
+struct emu_channel {
+    bool open, on;
+    unsigned char flags;
+    u32 bitrate, data_bitrate;
+    u32 gen_id;
+    double gen_due;
+    unsigned int err_seq;
+    unsigned char tec, rec;
+    double err_due;
+};
+
+struct emu_ep_io {
+    struct usb_raw_ep_io inner;
+    unsigned char data[EMU_LIVE_OUT_SIZE];
+};
+
+struct emu_control_event {
+    struct usb_raw_event inner;
+    struct usb_ctrlrequest ctrl;
+};
+
+static struct {
+    const char *udc_driver, *udc_device;
+    unsigned int channels;
+    unsigned int fw[4];
+    bool bridge;
+    unsigned int rate;   // generated frames per second and channel
+    unsigned int gen_dlc;
+    bool fd_mix;
+    unsigned int err_rate; // ERR records per second and channel
+    unsigned int drop_resp;
+    bool verbose;
+} opt = {
+    .udc_driver = "dummy_udc",
+    .udc_device = "dummy_udc.0",
+    .channels = 2,
+    .fw = { 2, 18, 0, 0 },
+    .gen_dlc = 8,
+};
+
+static int fd;
+static int ep_cmd_in = -1, ep_cmd_out = -1, ep_live_in = -1, ep_live_out = -1;
+static bool threads_started;
+static volatile sig_atomic_t stop;
+
+// device state, changed by the command thread and read by the live data threads
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct emu_channel channel[EMU_MAX_CHANNELS];
+static bool live_data;
+
+// records waiting for EP3 IN
+static unsigned char queue[EMU_QUEUE_SIZE];
+static unsigned int queue_head, queue_tail;
+
+static struct {
+    unsigned long commands, responses_dropped;
+    unsigned long tx_transfers, tx_frames, tx_bad;
+    unsigned long rx_transfers, rx_records, rx_overruns;
+    unsigned long rx_fd, rx_errors;
+} stats;
+
+// block UID of a channel: kind 0 RX, 1 TX, 2 ERR, as CAN_BLOCK_UID_GET reports;
+// RX and TX follow the 100 + channel / 1200 + channel numbering of the firmware
+static u16 block_uid(unsigned int ch, unsigned int kind)
+{
+    static const u16 base[3] = { 100, 1200, 2300 };
+
+    return base[kind] + ch;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// device timestamps count microseconds and wrap at 32 bits
+static u32 timestamp(void)
+{
+    return (u32)(now_s() * 1e6);
+}
+
+static void die(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+// queues one record for the host, called with lock held
+static void queue_raw(const unsigned char *rec, unsigned int size)
+{
+    unsigned int i;
+
+    if (EMU_QUEUE_SIZE - (queue_head - queue_tail) < size)
+    {
+        stats.rx_overruns++;
+        return;
+    }
+
+    for (i = 0; i < size; i++)
+        queue[(queue_head + i) % EMU_QUEUE_SIZE] = rec[i];
+    queue_head += size;
+    pthread_cond_signal(&queue_cond);
+}
+
+static void queue_record(u16 uid, u32 canid, unsigned char flags, const unsigned char *data,
+                         unsigned char len)
+{
+    unsigned char rec[RexRecordMaxLength];
+    unsigned int size;
+
+    size = frame2rec(rec, uid, canid, flags, data, len);
+    put_unaligned_le32(timestamp(), rec + RexRecordHeaderLength);
+    queue_raw(rec, size);
+}
+
+/* ep0 */
+
+static const struct usb_device_descriptor device_desc = {
+    .bLength = USB_DT_DEVICE_SIZE,
+    .bDescriptorType = USB_DT_DEVICE,
+    .bcdUSB = 0x0200,
+    .bMaxPacketSize0 = 64,
+    .idVendor = EMU_VENDOR_ID,
+    .idProduct = EMU_PRODUCT_ID,
+    .bcdDevice = 0x0100,
+    .iManufacturer = 1,
+    .iProduct = 2,
+    .iSerialNumber = 3,
+    .bNumConfigurations = 1,
+};
+
+static const struct usb_qualifier_descriptor qualifier_desc = {
+    .bLength = sizeof(struct usb_qualifier_descriptor),
+    .bDescriptorType = USB_DT_DEVICE_QUALIFIER,
+    .bcdUSB = 0x0200,
+    .bMaxPacketSize0 = 64,
+    .bNumConfigurations = 1,
+};
+
+// matched by endpoint number in setup_endpoints()
+#define EMU_BULK_EP(addr) {                     \
+    .bLength = USB_DT_ENDPOINT_SIZE,            \
+    .bDescriptorType = USB_DT_ENDPOINT,         \
+    .bEndpointAddress = (addr),                 \
+    .bmAttributes = USB_ENDPOINT_XFER_BULK,     \
+    .wMaxPacketSize = EMU_MAX_PACKET,           \
+}
+
+static struct usb_endpoint_descriptor ep_desc[4] = {
+    EMU_BULK_EP(USB_DIR_IN | 2),
+    EMU_BULK_EP(USB_DIR_OUT | 2),
+    EMU_BULK_EP(USB_DIR_IN | 3),
+    EMU_BULK_EP(USB_DIR_OUT | 3),
+};
+
+static unsigned int config_desc(unsigned char *buff)
+{
+    struct usb_config_descriptor config = {
+        .bLength = USB_DT_CONFIG_SIZE,
+        .bDescriptorType = USB_DT_CONFIG,
+        .bNumInterfaces = 1,
+        .bConfigurationValue = 1,
+        .bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER,
+        .bMaxPower = 50,
+    };
+    struct usb_interface_descriptor intf = {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bNumEndpoints = 4,
+        .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+    };
+    unsigned int len = 0, i;
+
+    memcpy(buff, &config, USB_DT_CONFIG_SIZE);
+    len += USB_DT_CONFIG_SIZE;
+    memcpy(buff + len, &intf, USB_DT_INTERFACE_SIZE);
+    len += USB_DT_INTERFACE_SIZE;
+    for (i = 0; i < 4; i++)
+    {
+        memcpy(buff + len, &ep_desc[i], USB_DT_ENDPOINT_SIZE);
+        len += USB_DT_ENDPOINT_SIZE;
+    }
+    put_unaligned_le16(len, buff + 2);
+
+    return len;
+}
+
+static unsigned int string_desc(unsigned char *buff, unsigned int index)
+{
+    static const char *strings[] = { NULL, "Influx Technology", "ReXgen emulator", "EMU0001" };
+    unsigned int len, i;
+
+    if (!index)
+    {
+        buff[0] = 4;
+        buff[1] = USB_DT_STRING;
+        put_unaligned_le16(0x0409, buff + 2);
+        return 4;
+    }
+    if (index >= sizeof(strings) / sizeof(strings[0]))
+        return 0;
+
+    len = strlen(strings[index]);
+    buff[0] = 2 + 2 * len;
+    buff[1] = USB_DT_STRING;
+    for (i = 0; i < len; i++)
+        put_unaligned_le16(strings[index][i], buff + 2 + 2 * i);
+
+    return buff[0];
+}
+
+static void *cmd_thread(void *arg);
+static void *live_out_thread(void *arg);
+static void *live_in_thread(void *arg);
+
+static int ep_enable(struct usb_endpoint_descriptor *desc)
+{
+    int ep = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, desc);
+
+    if (ep < 0)
+        die("USB_RAW_IOCTL_EP_ENABLE");
+    return ep;
+}
+
+static void set_configuration(void)
+{
+    pthread_t thread;
+
+    if (threads_started)
+        return;
+
+    ep_cmd_in = ep_enable(&ep_desc[0]);
+    ep_cmd_out = ep_enable(&ep_desc[1]);
+    ep_live_in = ep_enable(&ep_desc[2]);
+    ep_live_out = ep_enable(&ep_desc[3]);
+
+    if (ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, 100) < 0)
+        die("USB_RAW_IOCTL_VBUS_DRAW");
+    if (ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+        die("USB_RAW_IOCTL_CONFIGURE");
+
+    if (pthread_create(&thread, NULL, cmd_thread, NULL) ||
+        pthread_create(&thread, NULL, live_out_thread, NULL) ||
+        pthread_create(&thread, NULL, live_in_thread, NULL))
+        die("pthread_create");
+    threads_started = true;
+}
+
+// returns the length of the IN data stage, -1 to stall
+static int handle_control(const struct usb_ctrlrequest *ctrl, unsigned char *buff)
+{
+    unsigned int value = ctrl->wValue;
+    int len;
+
+    if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
+        return -1;
+
+    switch (ctrl->bRequest) {
+    case USB_REQ_GET_DESCRIPTOR:
+        switch (value >> 8) {
+        case USB_DT_DEVICE:
+            memcpy(buff, &device_desc, sizeof(device_desc));
+            return sizeof(device_desc);
+        case USB_DT_DEVICE_QUALIFIER:
+            memcpy(buff, &qualifier_desc, sizeof(qualifier_desc));
+            return sizeof(qualifier_desc);
+        case USB_DT_CONFIG:
+            return config_desc(buff);
+        case USB_DT_STRING:
+            len = string_desc(buff, value & 0xff);
+            return len ? len : -1;
+        }
+        return -1;
+    case USB_REQ_SET_CONFIGURATION:
+        if ((value & 0xff) == 1)
+            set_configuration();
+        return 0;
+    case USB_REQ_SET_INTERFACE:
+        return 0;
+    case USB_REQ_GET_INTERFACE:
+        buff[0] = 0;
+        return 1;
+    case USB_REQ_GET_STATUS:
+        put_unaligned_le16(1, buff); // self powered
+        return 2;
+    }
+
+    return -1;
+}
+
+static void ep0_loop(void)
+{
+    struct emu_control_event event;
+    struct {
+        struct usb_raw_ep_io inner;
+        unsigned char data[EMU_EP0_SIZE];
+    } io;
+    int len;
+
+    while (!stop)
+    {
+        event.inner.type = 0;
+        event.inner.length = sizeof(event.ctrl);
+        if (ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            die("USB_RAW_IOCTL_EVENT_FETCH");
+        }
+
+        if (event.inner.type != USB_RAW_EVENT_CONTROL)
+        {
+            if (opt.verbose)
+                fprintf(stderr, "rexgen_emu: event %u\n", event.inner.type);
+            continue;
+        }
+
+        len = handle_control(&event.ctrl, io.data);
+        if (len < 0)
+        {
+            if (opt.verbose)
+                fprintf(stderr, "rexgen_emu: stall request %02x/%02x\n",
+                        event.ctrl.bRequestType, event.ctrl.bRequest);
+            ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+            continue;
+        }
+
+        io.inner.ep = 0;
+        io.inner.flags = 0;
+        if (event.ctrl.bRequestType & USB_DIR_IN)
+        {
+            io.inner.length = len < event.ctrl.wLength ? len : event.ctrl.wLength;
+            if (ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, &io) < 0)
+                perror("USB_RAW_IOCTL_EP0_WRITE");
+        }
+        else
+        {
+            // status stage of a request without data
+            io.inner.length = 0;
+            if (ioctl(fd, USB_RAW_IOCTL_EP0_READ, &io) < 0)
+                perror("USB_RAW_IOCTL_EP0_READ");
+        }
+    }
+}
+
+/* commands, EP2 */
+
+static unsigned int handle_cmd(const unsigned char *cmd, unsigned int len, unsigned char *payload)
+{
+    const unsigned char *args = cmd + RexCmdArgsOffset;
+    unsigned int nargs = len - RexCmdArgsOffset - 1;
+    unsigned int ch = nargs >= 2 ? get_unaligned_le16(args) : 0;
+    struct emu_channel *c = ch < opt.channels ? &channel[ch] : NULL;
+    unsigned int size = RESP_STATUS;
+
+    memset(payload, 0, RESP_FW_VERSION);
+    pthread_mutex_lock(&lock);
+    switch (cmd[3]) {
+    case CMD_GET_FW_VERSION:
+        put_unaligned_le16(opt.fw[0], payload);
+        payload[2] = opt.fw[1];
+        payload[3] = opt.fw[2];
+        payload[4] = opt.fw[3];
+        size = RESP_FW_VERSION;
+        break;
+    case CMD_CAN_BUS_COUNT:
+        payload[0] = opt.channels;
+        size = RESP_BUS_COUNT;
+        break;
+    case CMD_CAN_BLOCK_UID_GET:
+        // the UID and two zero bytes, an unknown channel or kind reads as all zeros
+        if (c && nargs >= 3 && args[2] < 3)
+            put_unaligned_le16(block_uid(ch, args[2]), payload);
+        break;
+    case CMD_START_LIVE_DATA:
+    case CMD_STOP_LIVE_DATA:
+        live_data = cmd[3] == CMD_START_LIVE_DATA;
+        size = RESP_LIVE_DATA;
+        break;
+    case CMD_CAN_BUS_OPEN:
+        if (c)
+        {
+            c->open = true;
+            c->flags = nargs >= 3 ? args[2] : 0;
+        }
+        break;
+    case CMD_CAN_BUS_CLOSE:
+        if (c)
+            c->open = c->on = false;
+        break;
+    case CMD_CAN_BUS_ON:
+    case CMD_CAN_BUS_OFF:
+        if (c)
+        {
+            c->on = c->open && cmd[3] == CMD_CAN_BUS_ON;
+            c->gen_due = c->err_due = now_s();
+            c->tec = c->rec = 0;
+        }
+        break;
+    case CMD_CAN_PARAM_SET:
+    case CMD_CAN_DATA_PARAM_SET:
+        if (c && nargs >= RexBittimingArgsLength)
+            *(cmd[3] == CMD_CAN_PARAM_SET ? &c->bitrate : &c->data_bitrate) = get_unaligned_le32(args + 2);
+        break;
+    case CMD_CAN_INTERFACE_ENABLE:
+    case CMD_CAN_INTERFACE_DISABLE:
+        break;
+    default:
+        if (opt.verbose)
+            fprintf(stderr, "rexgen_emu: unknown command %02x\n", cmd[3]);
+        break;
+    }
+
+    if (opt.verbose && c)
+        fprintf(stderr, "rexgen_emu: command %02x channel %u: open %d on %d flags %02x bitrate %u/%u\n",
+                cmd[3], ch, c->open, c->on, c->flags, c->bitrate, c->data_bitrate);
+    pthread_mutex_unlock(&lock);
+
+    return size;
+}
+
+static void *cmd_thread(void *arg)
+{
+    struct emu_ep_io in, out;
+    unsigned char sum;
+    unsigned int len, size, i;
+    int res;
+
+    (void)arg;
+    while (!stop)
+    {
+        out.inner.ep = ep_cmd_out;
+        out.inner.flags = 0;
+        out.inner.length = EMU_CMD_SIZE;
+        res = ioctl(fd, USB_RAW_IOCTL_EP_READ, &out);
+        if (res < 0)
+            break;
+
+        len = res;
+        if (len < RexCmdArgsOffset + 1 || get_unaligned_le16(out.data + 1) != len)
+        {
+            fprintf(stderr, "rexgen_emu: malformed command of %u bytes\n", len);
+            continue;
+        }
+        for (sum = 0, i = 0; i < len - 1; i++)
+            sum += out.data[i];
+        if (sum != out.data[len - 1])
+        {
+            fprintf(stderr, "rexgen_emu: bad checksum of command %02x\n", out.data[3]);
+            continue;
+        }
+
+        stats.commands++;
+        size = handle_cmd(out.data, len, in.data + RexCmdArgsOffset);
+        if (opt.drop_resp && stats.commands % opt.drop_resp == 0)
+        {
+            stats.responses_dropped++;
+            continue;
+        }
+
+        // the sequence byte and the command code are echoed
+        in.data[0] = out.data[0];
+        in.data[3] = out.data[3];
+        in.data[4] = 0;
+        len = RexCmdArgsOffset + size + 1;
+        put_unaligned_le16(len, in.data + 1);
+        build_check_sum(in.data, len);
+
+        in.inner.ep = ep_cmd_in;
+        in.inner.flags = 0;
+        in.inner.length = len;
+        if (ioctl(fd, USB_RAW_IOCTL_EP_WRITE, &in) < 0)
+            break;
+    }
+
+    perror("rexgen_emu: command endpoint");
+    return NULL;
+}
+
+/* live data, EP3 */
+
+// frames transmitted by the host: records of the TX block UIDs, no block header
+static void handle_tx_frames(const unsigned char *buff, unsigned int len)
+{
+    unsigned int pos = 0, ch, other;
+    usb_record rec;
+    int size;
+    u32 canid;
+
+    pthread_mutex_lock(&lock);
+    while (pos < len)
+    {
+        size = ptr2rec(&rec, buff + pos, len - pos);
+        if (!size || rec.infsize != RexRecordCanInfLength)
+        {
+            stats.tx_bad++;
+            break;
+        }
+        pos += size;
+
+        for (ch = 0; ch < opt.channels; ch++)
+            if (rec.uid == block_uid(ch, 1))
+                break;
+        if (ch == opt.channels)
+        {
+            stats.tx_bad++;
+            continue;
+        }
+
+        stats.tx_frames++;
+        if (!channel[ch].on || (channel[ch].flags & CAN_INTERFACE_LISTENONLY) || !live_data)
+            continue;
+
+        canid = get_unaligned_le32(rec.inf + 4);
+        if (channel[ch].flags & CAN_INTERFACE_LOOPBACK)
+            queue_record(block_uid(ch, 1), canid, rec.inf[8] | DataFrame_DIR, rec.data, rec.dlc);
+
+        if (opt.bridge)
+            for (other = 0; other < opt.channels; other++)
+                if (other != ch && channel[other].on)
+                    queue_record(block_uid(other, 0), canid, rec.inf[8], rec.data, rec.dlc);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void *live_out_thread(void *arg)
+{
+    struct emu_ep_io out;
+    int res;
+
+    (void)arg;
+    while (!stop)
+    {
+        out.inner.ep = ep_live_out;
+        out.inner.flags = 0;
+        out.inner.length = EMU_LIVE_OUT_SIZE;
+        res = ioctl(fd, USB_RAW_IOCTL_EP_READ, &out);
+        if (res < 0)
+            break;
+
+        stats.tx_transfers++;
+        handle_tx_frames(out.data, res);
+    }
+
+    perror("rexgen_emu: live data OUT endpoint");
+    return NULL;
+}
+
+// --fd-mix: the data lengths cycled through, classic ones and every CAN FD length
+static const unsigned char mix_len[] = { 0, 8, 12, 1, 16, 64, 2, 20, 24, 8, 32, 48, 4, 64 };
+
+static void generate_frame(unsigned int ch, struct emu_channel *c)
+{
+    unsigned char data[RexRecordMaxCanLength];
+    unsigned char flags = 0, len = opt.gen_dlc;
+    bool fd = c->flags & (CAN_INTERFACE_FD_ISO | CAN_INTERFACE_FD_NON_ISO);
+
+    if (opt.fd_mix)
+    {
+        len = mix_len[c->gen_id % sizeof(mix_len)];
+        // every other round of the table is sent with bit rate switch
+        if ((c->gen_id / sizeof(mix_len)) & 1)
+            flags |= DataFrame_BRS;
+    }
+
+    // a classic channel does not see FD frames, short FD frames only come
+    // from the mix and only with BRS, so the classic lengths stay classic
+    if (!fd)
+    {
+        if (len > 8)
+            len = 8;
+        flags = 0;
+    }
+    else if (len > 8 || (flags & DataFrame_BRS))
+        flags |= DataFrame_EDL;
+
+    memset(data, 0, sizeof(data));
+    put_unaligned_le32(c->gen_id, data);
+    queue_record(block_uid(ch, 0), c->gen_id & 0x7ff, flags, data, len);
+    if (flags & DataFrame_EDL)
+        stats.rx_fd++;
+    c->gen_id++;
+}
+
+// --err-rate: one bus error, the counters climb to error passive and are then
+// reset as if the bus had recovered, so every state change is seen
+static void generate_error(unsigned int ch, struct emu_channel *c)
+{
+    unsigned char rec[RexRecordHeaderLength + RexRecordErrInfLength];
+    unsigned char *inf = rec + RexRecordHeaderLength;
+    unsigned char status = 0;
+
+    if (c->tec >= 136)
+        c->tec = c->rec = 0;
+    else
+    {
+        c->tec += 8;
+        c->rec += 1;
+    }
+
+    if (c->tec >= 128 || c->rec >= 128)
+        status |= ErrFrame_PASSIVE;
+    else if (c->tec >= 96 || c->rec >= 96)
+        status |= ErrFrame_WARNING;
+
+    put_unaligned_le16(block_uid(ch, 2), rec);
+    rec[2] = RexRecordErrInfLength;
+    rec[3] = 0;
+    put_unaligned_le32(timestamp(), inf);
+    inf[4] = status;
+    inf[5] = c->tec ? ErrCode_STUFF + c->err_seq++ % ErrCode_CRC : ErrCode_NONE;
+    inf[6] = c->tec;
+    inf[7] = c->rec;
+    queue_raw(rec, sizeof(rec));
+    stats.rx_errors++;
+}
+
+// --rate / --err-rate: records of every on-bus channel that are due, called
+// with lock held
+static void generate_records(void)
+{
+    double t = now_s();
+    unsigned int ch;
+
+    for (ch = 0; ch < opt.channels; ch++)
+    {
+        struct emu_channel *c = &channel[ch];
+
+        if (!c->on)
+            continue;
+
+        // catch up at most 100 ms after a stall
+        if (c->gen_due < t - 0.1)
+            c->gen_due = t - 0.1;
+        if (c->err_due < t - 0.1)
+            c->err_due = t - 0.1;
+
+        for (; opt.rate && c->gen_due <= t; c->gen_due += 1.0 / opt.rate)
+            generate_frame(ch, c);
+        for (; opt.err_rate && c->err_due <= t; c->err_due += 1.0 / opt.err_rate)
+            generate_error(ch, c);
+    }
+}
+
+static void *live_in_thread(void *arg)
+{
+    struct emu_ep_io in;
+    struct timespec deadline;
+    unsigned int len, size, records;
+
+    (void)arg;
+    while (!stop)
+    {
+        pthread_mutex_lock(&lock);
+        if ((opt.rate || opt.err_rate) && live_data)
+            generate_records();
+
+        while (queue_head == queue_tail || !live_data)
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 1000000;
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            if (pthread_cond_timedwait(&queue_cond, &lock, &deadline) == ETIMEDOUT &&
+                (opt.rate || opt.err_rate) && live_data)
+                generate_records();
+        }
+
+        // one block of whole records
+        len = 2;
+        records = 0;
+        while (queue_tail != queue_head)
+        {
+            unsigned char hdr[RexRecordHeaderLength];
+            unsigned int i;
+
+            for (i = 0; i < RexRecordHeaderLength; i++)
+                hdr[i] = queue[(queue_tail + i) % EMU_QUEUE_SIZE];
+            size = RexRecordHeaderLength + hdr[2] + hdr[3];
+            if (len + size > EMU_LIVE_IN_SIZE)
+                break;
+
+            for (i = 0; i < size; i++)
+                in.data[len + i] = queue[(queue_tail + i) % EMU_QUEUE_SIZE];
+            queue_tail += size;
+            len += size;
+            records++;
+        }
+        pthread_mutex_unlock(&lock);
+
+        put_unaligned_le16(len - 2, in.data);
+        stats.rx_records += records;
+
+        in.inner.ep = ep_live_in;
+        in.inner.flags = 0;
+        in.inner.length = len;
+        if (ioctl(fd, USB_RAW_IOCTL_EP_WRITE, &in) < 0)
+            break;
+        stats.rx_transfers++;
+    }
+
+    perror("rexgen_emu: live data IN endpoint");
+    return NULL;
+}
+
+/* setup */
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: rexgen_emu [options]\n"
+        "  -c, --channels N      CAN channels (default 2, at most %d)\n"
+        "  -f, --firmware A.B.C  reported firmware version (default 2.18.0)\n"
+        "  -b, --bridge          frames sent on a channel are received on the others\n"
+        "  -r, --rate N          generated frames per second on every on-bus channel\n"
+        "  -l, --length N        data length of the generated frames (default 8)\n"
+        "  -m, --fd-mix          mix classic, FD and FD+BRS lengths in the generated frames\n"
+        "  -e, --err-rate N      ERR block records (bus errors) per second on every on-bus channel\n"
+        "  -d, --drop-resp N     drop every N-th command response\n"
+        "      --udc-driver S    UDC driver name (default dummy_udc)\n"
+        "      --udc-device S    UDC device name (default dummy_udc.0)\n"
+        "  -v, --verbose\n", EMU_MAX_CHANNELS);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "channels", required_argument, NULL, 'c' },
+        { "firmware", required_argument, NULL, 'f' },
+        { "bridge", no_argument, NULL, 'b' },
+        { "rate", required_argument, NULL, 'r' },
+        { "length", required_argument, NULL, 'l' },
+        { "fd-mix", no_argument, NULL, 'm' },
+        { "err-rate", required_argument, NULL, 'e' },
+        { "drop-resp", required_argument, NULL, 'd' },
+        { "udc-driver", required_argument, NULL, 1 },
+        { "udc-device", required_argument, NULL, 2 },
+        { "verbose", no_argument, NULL, 'v' },
+        { NULL, 0, NULL, 0 },
+    };
+    struct usb_raw_init init;
+    struct sigaction sa;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "c:f:br:l:me:d:v", options, NULL)) != -1)
+    {
+        switch (c) {
+        case 'c':
+            opt.channels = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            if (sscanf(optarg, "%u.%u.%u.%u", &opt.fw[0], &opt.fw[1], &opt.fw[2], &opt.fw[3]) < 3)
+                usage();
+            break;
+        case 'b':
+            opt.bridge = true;
+            break;
+        case 'r':
+            opt.rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            opt.gen_dlc = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            opt.fd_mix = true;
+            break;
+        case 'e':
+            opt.err_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            opt.drop_resp = strtoul(optarg, NULL, 0);
+            break;
+        case 1:
+            opt.udc_driver = optarg;
+            break;
+        case 2:
+            opt.udc_device = optarg;
+            break;
+        case 'v':
+            opt.verbose = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (!opt.channels || opt.channels > EMU_MAX_CHANNELS || opt.gen_dlc > RexRecordMaxCanLength)
+        usage();
+
+    fd = open("/dev/raw-gadget", O_RDWR);
+    if (fd < 0)
+        die("open /dev/raw-gadget");
+
+    memset(&init, 0, sizeof(init));
+    strncpy((char *)init.driver_name, opt.udc_driver, UDC_NAME_LENGTH_MAX - 1);
+    strncpy((char *)init.device_name, opt.udc_device, UDC_NAME_LENGTH_MAX - 1);
+    init.speed = USB_SPEED_HIGH;
+    if (ioctl(fd, USB_RAW_IOCTL_INIT, &init) < 0)
+        die("USB_RAW_IOCTL_INIT");
+    if (ioctl(fd, USB_RAW_IOCTL_RUN, 0) < 0)
+        die("USB_RAW_IOCTL_RUN");
+
+    // no SA_RESTART, a blocked event fetch returns with EINTR
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    fprintf(stderr, "rexgen_emu: %u channels on %s, firmware %u.%u.%u.%u\n",
+            opt.channels, opt.udc_device, opt.fw[0], opt.fw[1], opt.fw[2], opt.fw[3]);
+    ep0_loop();
+
+    fprintf(stderr, "rexgen_emu: %lu commands (%lu responses dropped), "
+            "TX %lu frames in %lu transfers (%lu bad), RX %lu records in %lu transfers "
+            "(%lu FD, %lu errors, %lu overruns)\n",
+            stats.commands, stats.responses_dropped, stats.tx_frames, stats.tx_transfers, stats.tx_bad,
+            stats.rx_records, stats.rx_transfers, stats.rx_fd, stats.rx_errors, stats.rx_overruns);
+    close(fd);
+    return 0;
+}
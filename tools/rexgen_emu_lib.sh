@@ -0,0 +1,79 @@
+# Helpers shared by the emulator driven tests, sourced by rexgen_stress.sh
+# and rexgen_scale.sh. Needs root, dummy_hcd, raw_gadget and the module.
+
+EMU=${EMU:-build/rexgen_emu}
+EMU_PIDS=
+EMU_LOGDIR=${EMU_LOGDIR:-$(mktemp -d /tmp/rexgen_emu.XXXXXX)}
+NETDEVS=
+
+# start_emulators DEVICES CHANNELS [rexgen_emu options...]
+# Loads dummy_hcd with one UDC per device and starts an emulator on each.
+start_emulators()
+{
+    local devices=$1 channels=$2 i
+    shift 2
+
+    [ -x "$EMU" ] || { echo "$EMU missing, run make emulator" >&2; return 1; }
+    modprobe -r dummy_hcd 2>/dev/null
+    modprobe dummy_hcd num="$devices" || return 1
+    modprobe raw_gadget || return 1
+    modprobe rexgen_usb 2>/dev/null || lsmod | grep -q '^rexgen_usb' || {
+        echo "rexgen_usb not loaded, run make install or insmod src/rexgen_usb.ko" >&2
+        return 1
+    }
+
+    for i in $(seq 0 $((devices - 1))); do
+        "$EMU" --channels "$channels" --udc-device "dummy_udc.$i" "$@" \
+            > "$EMU_LOGDIR/emu$i.log" 2>&1 &
+        EMU_PIDS="$EMU_PIDS $!"
+    done
+    wait_netdevs $((devices * channels))
+}
+
+# wait_netdevs COUNT: waits up to 30 s for COUNT rexgen_usb netdevs
+wait_netdevs()
+{
+    local want=$1 n i
+
+    for i in $(seq 60); do
+        find_netdevs
+        n=$(echo $NETDEVS | wc -w)
+        [ "$n" -ge "$want" ] && return 0
+        sleep 0.5
+    done
+    echo "only $n of $want CAN interfaces appeared, see $EMU_LOGDIR" >&2
+    return 1
+}
+
+find_netdevs()
+{
+    local d
+
+    NETDEVS=
+    for d in /sys/class/net/*; do
+        [ "$(basename "$(readlink "$d/device/driver" 2>/dev/null)")" = rexgen_usb ] &&
+            NETDEVS="$NETDEVS $(basename "$d")"
+    done
+}
+
+# stop_emulators: SIGINT makes each emulator print its counters to its log
+stop_emulators()
+{
+    local pid n
+
+    for n in $NETDEVS; do
+        ip link set "$n" down 2>/dev/null
+    done
+    for pid in $EMU_PIDS; do
+        kill -INT "$pid" 2>/dev/null
+    done
+    wait $EMU_PIDS 2>/dev/null
+    EMU_PIDS=
+    modprobe -r dummy_hcd 2>/dev/null
+    echo "emulator logs in $EMU_LOGDIR"
+}
+
+netdev_stat()
+{
+    cat "/sys/class/net/$1/statistics/$2"
+}
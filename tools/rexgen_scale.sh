@@ -0,0 +1,104 @@
+#!/bin/bash
+# Runs generated traffic on several emulated ReXgen devices and reports the
+# received frames per second of every device next to the load of every CPU,
+# to compare spreading the RX processing (rx_cpu) against leaving it where
+# the host controller interrupt lands.
+#
+# usage: tools/rexgen_scale.sh [-n devices] [-c channels] [-r rate] [-t seconds] [-s]
+#   -s  bind the RX processing of device K to CPU K modulo the online CPUs
+
+DEVICES=8
+CHANNELS=2
+RATE=5000
+SECONDS_RUN=10
+SPREAD=0
+
+while getopts "n:c:r:t:s" opt; do
+    case $opt in
+    n) DEVICES=$OPTARG ;;
+    c) CHANNELS=$OPTARG ;;
+    r) RATE=$OPTARG ;;
+    t) SECONDS_RUN=$OPTARG ;;
+    s) SPREAD=1 ;;
+    *) sed -n '7,8p' "$0" >&2; exit 2 ;;
+    esac
+done
+
+. "$(dirname "$0")/rexgen_emu_lib.sh"
+
+trap stop_emulators EXIT
+start_emulators "$DEVICES" "$CHANNELS" --rate "$RATE" || exit 1
+
+# the USB interfaces, each one a device with its channels
+intfs=$(for n in $NETDEVS; do readlink -f "/sys/class/net/$n/device"; done | sort -u)
+
+if [ "$SPREAD" -eq 1 ]; then
+    cpus=$(nproc)
+    k=0
+    for i in $intfs; do
+        echo $((k % cpus)) > "$i/rx_cpu"
+        k=$((k + 1))
+    done
+fi
+
+for n in $NETDEVS; do
+    ip link set "$n" type can bitrate 1000000 && ip link set "$n" up || exit 1
+done
+sleep 1
+
+device_rx()
+{
+    local sum=0 n
+
+    for n in "$1"/net/*; do
+        sum=$((sum + $(cat "$n/statistics/rx_packets")))
+    done
+    echo $sum
+}
+
+k=0
+for i in $intfs; do
+    eval "rx0_$k=$(device_rx "$i")"
+    k=$((k + 1))
+done
+grep '^cpu[0-9]' /proc/stat > "$EMU_LOGDIR/stat0"
+grep 'NET_RX' /proc/softirqs > "$EMU_LOGDIR/softirqs0"
+
+sleep "$SECONDS_RUN"
+
+grep '^cpu[0-9]' /proc/stat > "$EMU_LOGDIR/stat1"
+grep 'NET_RX' /proc/softirqs > "$EMU_LOGDIR/softirqs1"
+
+echo "$DEVICES devices, $CHANNELS channels, $RATE frames/s per channel, ${SECONDS_RUN}s"
+printf "%-8s %-8s %-16s %s\n" device rx_cpu frames/s interfaces
+k=0
+total=0
+for i in $intfs; do
+    eval "rx0=\$rx0_$k"
+    rate=$((($(device_rx "$i") - rx0) / SECONDS_RUN))
+    total=$((total + rate))
+    printf "%-8s %-8s %-16s %s\n" "$k" "$(cat "$i/rx_cpu")" "$rate" "$(ls "$i/net" | tr '\n' ' ')"
+    k=$((k + 1))
+done
+echo "total $total frames/s"
+echo
+
+# busy and softirq share of every CPU from /proc/stat, NET_RX softirqs/s
+printf "%-6s %-8s %-10s %s\n" cpu busy% softirq% NET_RX/s
+paste "$EMU_LOGDIR/stat0" "$EMU_LOGDIR/stat1" | awk -v secs="$SECONDS_RUN" \
+    -v rx0="$(cut -d: -f2 "$EMU_LOGDIR/softirqs0")" \
+    -v rx1="$(cut -d: -f2 "$EMU_LOGDIR/softirqs1")" '
+    BEGIN { split(rx0, a); split(rx1, b) }
+    {
+        # user nice system idle iowait irq softirq steal, then the same again
+        n = (NF / 2)
+        all = 0
+        for (f = 2; f <= 9; f++)
+            all += $(f + n) - $f
+        idle = $(5 + n) - $5 + $(6 + n) - $6
+        soft = $(8 + n) - $8
+        if (all == 0)
+            all = 1
+        printf "%-6s %-8.1f %-10.1f %d\n", $1, 100 * (all - idle) / all,
+            100 * soft / all, (b[NR] - a[NR]) / secs
+    }'
@@ -0,0 +1,90 @@
+#!/bin/bash
+# Brings all channels of several emulated ReXgen devices up at once, cycles
+# the bitrates and sends traffic between them. Every bring-up runs the whole
+# command sequence of all devices in parallel, with --drop-resp the command
+# retries race with the other devices too.
+#
+# usage: tools/rexgen_stress.sh [-n devices] [-c channels] [-i iterations]
+#                               [-f frames] [-d drop-resp]
+
+DEVICES=4
+CHANNELS=2
+ITERATIONS=20
+FRAMES=500
+DROP=0
+BITRATES="125000 250000 500000 1000000"
+
+while getopts "n:c:i:f:d:" opt; do
+    case $opt in
+    n) DEVICES=$OPTARG ;;
+    c) CHANNELS=$OPTARG ;;
+    i) ITERATIONS=$OPTARG ;;
+    f) FRAMES=$OPTARG ;;
+    d) DROP=$OPTARG ;;
+    *) sed -n '8,9p' "$0" >&2; exit 2 ;;
+    esac
+done
+
+. "$(dirname "$0")/rexgen_emu_lib.sh"
+
+command -v cangen > /dev/null || { echo "cangen missing, install can-utils" >&2; exit 2; }
+
+trap stop_emulators EXIT
+start_emulators "$DEVICES" "$CHANNELS" --bridge --drop-resp "$DROP" || exit 1
+echo "$DEVICES devices, $CHANNELS channels each:$NETDEVS"
+
+failures=0
+fail()
+{
+    echo "iteration $iter: $*" >&2
+    failures=$((failures + 1))
+}
+
+for iter in $(seq "$ITERATIONS"); do
+    set -- $BITRATES
+    shift $(((iter - 1) % $#))
+    bitrate=$1
+
+    for n in $NETDEVS; do
+        ip link set "$n" down
+    done
+
+    # all bring-ups at the same time, each one is a full command sequence
+    pids=
+    for n in $NETDEVS; do
+        ip link set "$n" type can bitrate "$bitrate" restart-ms 100 &&
+            ip link set "$n" up &
+        pids="$pids $!"
+    done
+    for pid in $pids; do
+        wait "$pid" || fail "bring-up failed"
+    done
+
+    for n in $NETDEVS; do
+        [ $(($(cat "/sys/class/net/$n/flags") & 1)) -eq 1 ] || fail "$n not up at $bitrate"
+        eval "rx_$n=$(netdev_stat "$n" rx_packets)"
+    done
+
+    # every channel sends, the bridge delivers to the other channels of its device
+    pids=
+    for n in $NETDEVS; do
+        cangen "$n" -g 1 -I i -L 8 -n "$FRAMES" &
+        pids="$pids $!"
+    done
+    for pid in $pids; do
+        wait "$pid" || fail "cangen failed"
+    done
+    sleep 1
+
+    if [ "$CHANNELS" -gt 1 ]; then
+        for n in $NETDEVS; do
+            eval "got=\$(($(netdev_stat "$n" rx_packets) - rx_$n))"
+            [ "$got" -ge "$FRAMES" ] || fail "$n received $got of at least $FRAMES frames"
+        done
+    fi
+    echo "iteration $iter at $bitrate: $failures failures so far"
+done
+
+dmesg | tail -n 200 | grep -i "rexgen.*\(timeout\|error\|fail\)" >&2
+echo "$failures failures in $ITERATIONS iterations"
+[ "$failures" -eq 0 ]
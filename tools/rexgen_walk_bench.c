@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: GPL-2.0
+/* 
+    USB to SocketCAN driver for ReXgen
+    Copyright (C) 1999-2021 Influx Technology LTD, UK. All rights reserved.
+    Contacts: https://www.influxtechnology.com/contact
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Throughput of the live data walker (make bench): walks a transfer of 512 byte
+// blocks full of classic CAN or CAN FD records, as the device sends them, and
+// reports records and bytes per second. Only the userspace build is measured,
+// not the NAPI poll around it.
+//
+//     build/rexgen_walk_bench [seconds per run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/rexgen_proto.h"
+
+#define BENCH_TRANSFER_SIZE 0x4000 // USB_TRANSFER_BLOCK_SIZE of the driver
+#define BENCH_BLOCK_SIZE    512
+
+static unsigned int build_transfer(unsigned char *buff, unsigned char dlc)
+{
+    unsigned char data[RexRecordMaxCanLength] = { 0 };
+    unsigned int len = 0, block, rec_len = RexRecordHeaderLength + RexRecordCanInfLength + dlc;
+    unsigned int id = 0;
+
+    while (len + 2 + rec_len <= BENCH_TRANSFER_SIZE)
+    {
+        block = len;
+        len += 2;
+        while (len - block + rec_len <= BENCH_BLOCK_SIZE && len + rec_len <= BENCH_TRANSFER_SIZE)
+            len += frame2rec(buff + len, 100, id++ & 0x7ff, dlc > 8 ? DataFrame_EDL : 0, data, dlc);
+        put_unaligned_le16(len - block - 2, buff + block);
+    }
+
+    return len;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(const char *name, unsigned char dlc, double seconds)
+{
+    static unsigned char buff[BENCH_TRANSFER_SIZE];
+    unsigned int len = build_transfer(buff, dlc), block, pos, i;
+    unsigned long records = 0, transfers = 0;
+    volatile unsigned int sink = 0;
+    double start = now(), elapsed;
+    enum rexgen_walk res;
+    usb_record rec;
+
+    do {
+        // check the clock every 1024 transfers only
+        for (i = 0; i < 1024; i++)
+        {
+            block = 0;
+            pos = 0;
+            while ((res = rexgen_walk_next(buff, len, &block, &pos, &rec)) != REXGEN_WALK_END)
+            {
+                if (res != REXGEN_WALK_RECORD)
+                    continue;
+
+                // what can2socket reads before it builds the skb
+                sink += rec.uid + get_unaligned_le32(rec.inf + 4) + rec.inf[8] + rec.dlc;
+                records++;
+            }
+        }
+        transfers += 1024;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    printf("%-10s %8.1f Mrecords/s %8.1f MB/s\n", name,
+           records / elapsed / 1e6, (double)transfers * len / elapsed / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = argc > 1 ? strtod(argv[1], NULL) : 1.0;
+
+    run("CAN 8", 8, seconds);
+    run("CAN FD 64", 64, seconds);
+    return 0;
+}
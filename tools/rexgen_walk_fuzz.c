@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0
+/* 
+    USB to SocketCAN driver for ReXgen
+    Copyright (C) 1999-2021 Influx Technology LTD, UK. All rights reserved.
+    Contacts: https://www.influxtechnology.com/contact
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Fuzz harness for the live data walker (make fuzz). Walks random and mutated
+// transfers with rexgen_walk_next() and checks that every record it maps lies
+// inside its block and that the walk ends. Built with ASan/UBSan, any out of
+// bounds read is reported by the sanitizers.
+//
+//     build/rexgen_walk_fuzz [iterations [seed]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/rexgen_proto.h"
+
+#define FUZZ_MAX_LEN 2048
+
+static uint64_t rng_state;
+
+static uint32_t rng(void)
+{
+    // xorshift64*, reproducible from the seed
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+// a well formed transfer, so that the mutations reach the record level
+static unsigned int build_transfer(unsigned char *buff, unsigned int max)
+{
+    unsigned char data[RexRecordMaxCanLength];
+    unsigned int len = 0, block, size;
+
+    while (len + 2 + RexRecordMaxLength <= max && rng() % 8)
+    {
+        block = len;
+        len += 2;
+        while (len - block + RexRecordMaxLength <= 512 && len + RexRecordMaxLength <= max && rng() % 4)
+        {
+            size = rng() % (RexRecordMaxCanLength + 1);
+            memset(data, rng(), size);
+            len += frame2rec(buff + len, rng() % 8, rng(), rng() & 0x1f, data, size);
+        }
+        put_unaligned_le16(len - block - 2, buff + block);
+    }
+
+    return len;
+}
+
+static void fail(const char *what, unsigned long iteration)
+{
+    fprintf(stderr, "rexgen_walk_fuzz: %s in iteration %lu\n", what, iteration);
+    exit(1);
+}
+
+static void walk(const unsigned char *buff, unsigned int len, unsigned long iteration)
+{
+    unsigned int block = 0, pos = 0, block_len = 0, steps = 0, start;
+    enum rexgen_walk res;
+    usb_record rec;
+
+    do {
+        res = rexgen_walk_next(buff, len, &block, &pos, &rec);
+
+        // every step moves forward by at least the record header or a length field
+        if (++steps > len + 1)
+            fail("walk does not end", iteration);
+        if (block > len)
+            fail("block offset past the buffer", iteration);
+
+        if (res == REXGEN_WALK_BLOCK)
+            block_len = get_unaligned_le16(buff + block) + 2;
+
+        if (res == REXGEN_WALK_RECORD)
+        {
+            start = block + pos - (RexRecordHeaderLength + rec.infsize + rec.dlc);
+            if (rec.inf != buff + start + RexRecordHeaderLength)
+                fail("record not at the walk position", iteration);
+            if (pos > block_len || block + block_len > len)
+                fail("record outside its block", iteration);
+            if (rec.data + rec.dlc > buff + len)
+                fail("record data past the buffer", iteration);
+        }
+    } while (res != REXGEN_WALK_END);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+    unsigned long i;
+    unsigned int len, n;
+    unsigned char *buff;
+
+    rng_state = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x5eed;
+    if (!rng_state)
+        rng_state = 1;
+
+    for (i = 0; i < iterations; i++)
+    {
+        unsigned char tmp[FUZZ_MAX_LEN];
+
+        switch (rng() % 3)
+        {
+        case 0: // random bytes
+            len = rng() % FUZZ_MAX_LEN;
+            for (n = 0; n < len; n++)
+                tmp[n] = rng();
+            break;
+        case 1: // well formed
+            len = build_transfer(tmp, FUZZ_MAX_LEN);
+            break;
+        default: // well formed, cut and with a few bytes flipped
+            len = build_transfer(tmp, FUZZ_MAX_LEN);
+            if (len)
+                len = rng() % (len + 1);
+            for (n = rng() % 4; n && len; n--)
+                tmp[rng() % len] ^= 1 << (rng() % 8);
+            break;
+        }
+
+        // an allocation of the exact length, ASan catches reads past it
+        buff = malloc(len ? len : 1);
+        if (!buff)
+            return 1;
+        memcpy(buff, tmp, len);
+        walk(buff, len, i);
+        free(buff);
+    }
+
+    printf("rexgen_walk_fuzz: %lu transfers walked\n", iterations);
+    return 0;
+}